@@ -0,0 +1,59 @@
+-- benchmark for ltro.batch(), copy to game.lua and start ltro1
+local ltro = require('ltro1')
+local count, rounds = 5000, 20
+local xs, ys, cs = {}, {}, {}
+for i = 1, count do
+    xs[i], ys[i], cs[i] = math.random(0, 239), math.random(0, 134), math.random(0, 9)
+end
+
+local function bench(name, fn)
+    local start = os.clock()
+    for _ = 1, rounds do fn() end
+    local elapsed = os.clock() - start
+    print(string.format('%-20s %8.3f ms/round %10.0f primitives/s', name, elapsed * 1000 / rounds, count * rounds / elapsed))
+end
+
+local function build(kind)
+    local cmds, strings, n = {}, {}, 0
+    for i = 1, count do
+        local c = kind == 'pixel' and { 1, cs[i], xs[i], ys[i] } or { 4, cs[i], xs[i], ys[i], xs[i] + 3, ys[i] + 3 }
+        for j = 1, #c do cmds[n + j] = c[j] end
+        n = n + #c
+        strings[i] = string.pack('<' .. string.rep('h', #c), table.unpack(c))
+    end
+    return cmds, table.concat(strings)
+end
+
+local function run(kind)
+    local cmds, packed = build(kind)
+    if kind == 'pixel' then
+        bench('pixel calls', function()
+            for i = 1, count do ltro.pixel(cs[i], xs[i], ys[i]) end
+        end)
+    else
+        bench('rectfill calls', function()
+            for i = 1, count do ltro.rect(cs[i], xs[i], ys[i], xs[i] + 3, ys[i] + 3, true) end
+        end)
+    end
+    bench(kind .. ' table', function() ltro.batch(cmds) end)
+    bench(kind .. ' string', function() ltro.batch(packed) end)
+    bench(kind .. ' build+table', function()
+        local t, n = {}, 0
+        for i = 1, count do
+            if kind == 'pixel' then
+                t[n + 1], t[n + 2], t[n + 3], t[n + 4] = 1, cs[i], xs[i], ys[i]
+                n = n + 4
+            else
+                t[n + 1], t[n + 2], t[n + 3], t[n + 4], t[n + 5], t[n + 6] = 4, cs[i], xs[i], ys[i], xs[i] + 3, ys[i] + 3
+                n = n + 6
+            end
+        end
+        ltro.batch(t)
+    end)
+end
+
+function ltro.on_init()
+    run('pixel')
+    run('rectfill')
+    ltro.quit()
+end
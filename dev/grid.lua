@@ -0,0 +1,61 @@
+-- checks ltro.grid() against brute force, run it as game.lua (e.g. ltro1 --headless)
+local ltro = require('ltro1')
+
+local function overlap(a, b)
+    return a[1] < b[1] + b[3] and b[1] < a[1] + a[3] and a[2] < b[2] + b[4] and b[2] < a[2] + a[4]
+end
+
+local function check(cell, boxes)
+    local grid, out = ltro.grid(cell), {}
+    for id, b in pairs(boxes) do grid:set(id, b[1], b[2], b[3], b[4]) end
+
+    -- every pair is reported once
+    local found, n = {}, select(2, grid:pairs(out))
+    for i = 1, n, 2 do
+        local a, b = math.min(out[i], out[i + 1]), math.max(out[i], out[i + 1])
+        assert(not found[a .. ':' .. b], 'duplicate pair')
+        found[a .. ':' .. b] = true
+    end
+    for a, ba in pairs(boxes) do
+        for b, bb in pairs(boxes) do
+            if a < b then assert(not found[a .. ':' .. b] == not overlap(ba, bb), 'wrong pair') end
+        end
+    end
+
+    -- queries and overlaps of every box
+    for id, b in pairs(boxes) do
+        local hits, count = {}, select(2, grid:overlaps(id, out))
+        for i = 1, count do hits[out[i]] = true end
+        for other, bo in pairs(boxes) do
+            assert((other ~= id and overlap(b, bo)) == (hits[other] or false), 'wrong overlaps')
+        end
+        count = select(2, grid:query(b[1], b[2], b[3], b[4], out))
+        assert(count == #(function() local t = {} for o, bo in pairs(boxes) do if overlap(b, bo) then t[#t + 1] = o end end return t end)(), 'wrong query')
+    end
+end
+
+math.randomseed(1)
+for round = 1, 50 do
+    local boxes = {}
+    for id = 1, 60 do
+        local large = math.random() < 0.1
+        boxes[id] = { math.random(-200, 200), math.random(-200, 200),
+                      large and math.random(100, 400) or math.random(1, 24), large and math.random(100, 400) or math.random(1, 24) }
+    end
+    check(math.random(1, 32), boxes)
+end
+
+-- boxes far larger than the grid must neither overflow nor hang
+local start = os.clock()
+check(1, { { 0, 0, 50000, 50000 }, { 10, 10, 2, 2 }, { -5, -5, 1, 1 } })
+check(8, { { 0, 0, 200000, 200000 }, { 1e9, 1e9, 1e9, 1e9 }, { 100, 100, 8, 8 } })
+assert(os.clock() - start < 1, 'large boxes are too slow')
+
+-- a set with invalid coordinates must not leave a half inserted box behind
+local grid, out = ltro.grid(8), {}
+grid:set(1, 0, 0, 8, 8)
+assert(not pcall(grid.set, grid, 2, 0, 0, 'wide', 8), 'invalid width accepted')
+assert(#grid == 1 and select(2, grid:query(0, 0, 8, 8, out)) == 1, 'failed set inserted a box')
+
+print('grid ok')
+ltro.quit()
@@ -0,0 +1,24 @@
+-- checks that changing the layers while a canvas is the target still redraws the whole screen, run it as game.lua:
+--   ltro1 --headless --frames 8
+local ltro = require('ltro1')
+
+local canvas = ltro.canvas(16, 16)
+local tiles = math.ceil(240 / 8) * math.ceil(135 / 8)
+
+function ltro.on_tick(c)
+    if c >= 2 then
+        -- the previous frame has to upload every tile
+        assert(ltro.stats().dirty_tiles == tiles, 'layer change while drawing into a canvas left stale tiles')
+    end
+    ltro.target(canvas)
+    if c == 0 then ltro.layers(2) end
+    if c == 1 then ltro.layers(3) end
+    if c == 2 then ltro.layer(1, c, 0) end
+    if c == 3 then ltro.layer(2, 0, c, 5) end
+    if c == 4 then ltro.layers(2) end
+    if c == 5 then
+        print('layers ok')
+        ltro.quit()
+    end
+    ltro.target(canvas)
+end
@@ -0,0 +1,26 @@
+-- checks that ltro.scroll() without a fill color leaves both exposed strips alone, run it as game.lua:
+--   ltro1 --headless --frames 3 --record scroll.rec   (draws the frames)
+--   ltro1 --headless                                  (compares the recorded frame hashes)
+local ltro = require('ltro1')
+
+local file = io.open('scroll.rec', 'rb')
+if file then
+    local data = file:read('a')
+    file:close()
+    local runs, count = string.unpack('<I4I4', data, 13)
+    local hashes, offset = {}, 21 + runs * 6
+    for i = 1, count do
+        local tick, hash = string.unpack('<I4I4', data, offset + (i - 1) * 8)
+        hashes[tick] = hash
+    end
+    assert(hashes[1] and hashes[1] == hashes[2] and hashes[2] == hashes[3], 'scroll without fill changed the exposed strips')
+    print('scroll ok')
+    ltro.quit()
+end
+
+function ltro.on_tick(c)
+    -- all three frames have to look the same
+    ltro.clear(5)
+    if c == 0 then ltro.scroll(3, 2) end
+    if c == 1 then ltro.scroll(3, 2, 5) end
+end
@@ -53,6 +53,14 @@
 /*----------------------------------------------------------------------------*/
 #include "SDL.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define LTRO_SIMD_X86
+    #include <immintrin.h>
+#elif defined(__aarch64__)
+    #define LTRO_SIMD_NEON
+    #include <arm_neon.h>
+#endif
+
 
 /*
 ================================================================================
@@ -62,7 +70,7 @@
 ================================================================================
 */
 /*----------------------------------------------------------------------------*/
-#define LTRO_VERSION        "0.5.0"
+#define LTRO_VERSION        "0.6.0"
 #define LTRO_AUTHOR         "Sebastian Steinhauer <s.steinhauer@yahoo.de>"
 
 
@@ -71,6 +79,10 @@
 #define SCREEN_HEIGHT       135
 #define SCREEN_PADDING      64
 #define SCREEN_TITLE        "LTRO-1 (Lospec game console)"
+#define SCREEN_TILE         8
+#define SCREEN_TILES_X      ((SCREEN_WIDTH + SCREEN_TILE - 1) / SCREEN_TILE)
+#define SCREEN_TILES_Y      ((SCREEN_HEIGHT + SCREEN_TILE - 1) / SCREEN_TILE)
+#define SCREEN_LAYERS       4
 
 
 /*----------------------------------------------------------------------------*/
@@ -86,24 +98,194 @@ enum {
 
 
 /*----------------------------------------------------------------------------*/
-#define FPS_TICKS           (1000.0 / 60.0)
+#define FPS                 60
+#define FPS_JITTER_WINDOW   60
+#define FPS_CATCHUP         4
+
+
+/*----------------------------------------------------------------------------*/
+#define REPLAY_MAGIC        "LTRR"
+#define REPLAY_HEADER       20
+#define REPLAY_RUN          6
+#define REPLAY_HASH         8
+
+enum { REPLAY_OFF, REPLAY_RECORD, REPLAY_PLAY };
+
+typedef struct replay_run_t {
+    Uint32                  ticks;
+    Uint8                   down, pressed;
+} replay_run_t;
+
+typedef struct replay_hash_t {
+    Uint32                  tick, hash;
+} replay_hash_t;
 
 
 /*----------------------------------------------------------------------------*/
 #define AUDIO_FREQUENCY     44100
-#define AUDIO_VOICES        2
+#define AUDIO_VOICES        16
+#define AUDIO_MUSIC_VOICES  2
+#define AUDIO_POOL_VOICES   2
+
+#define AUDIO_COMMANDS      256
+#define MML_PASSES          16
 
 enum { PSG_50, PSG_25, PSG_12 };
+enum { AUDIO_PLAY, AUDIO_STOP, AUDIO_GAIN };
+enum { VOICE_OLDEST, VOICE_QUIETEST };
+
+typedef struct mml_state_t {
+    int                     psg, octave;
+    float                   tempo, length;
+} mml_state_t;
+
+typedef struct mml_event_t {
+    int                     ttl;
+    Uint32                  step, duty;
+    float                   e1;
+} mml_event_t;
+
+typedef struct mml_song_t {
+    int                     count, loop;
+    mml_event_t             events[1];
+} mml_song_t;
+
+typedef struct audio_command_t {
+    int                     type, voice;
+    mml_song_t              *song;
+    float                   gain;
+    Uint64                  sent;
+} audio_command_t;
+
+typedef struct voice_slot_t {
+    int                     gen, priority;
+    Uint64                  started, ends;
+} voice_slot_t;
 
 typedef struct audio_voice_t {
-    char                    song[4096], *mml;
-    int                     psg;
-    float                   octave, tempo, length;
-    int                     ttl, t0, t1, t2;
+    mml_song_t              *song;
+    int                     event;
+    int                     ttl;
+    Uint32                  phase, step, duty;
     float                   e0, e1;
 } audio_voice_t;
 
 
+/*----------------------------------------------------------------------------*/
+#define POOL_CHUNK_SIZE     (64 * 1024)
+#define POOL_MIN_SHIFT      5
+#define POOL_MAX_SHIFT      14
+#define POOL_CLASSES        (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+
+typedef struct pool_block_t {
+    struct pool_block_t     *next;
+} pool_block_t;
+
+typedef struct pool_chunk_t {
+    struct pool_chunk_t     *next;
+} pool_chunk_t;
+
+
+/*----------------------------------------------------------------------------*/
+#define SPRITE_META         "ltro_sprite"
+
+typedef struct image_span_t {
+    Uint16                  x, w;
+} image_span_t;
+
+typedef struct sprite_t {
+    int                     w, h;
+    size_t                  size;
+    Uint8                   *pixels;
+    image_span_t            *spans;
+    int                     *rows;
+    struct sprite_t         *variants[8];
+    Uint64                  *bits;
+} sprite_t;
+
+enum { FLIP_X = 1, FLIP_Y = 2, ROTATE_90 = 4 };
+
+
+/*----------------------------------------------------------------------------*/
+#define SHEET_META          "ltro_sheet"
+
+typedef struct sheet_t {
+    int                     count;
+    size_t                  size;
+    sprite_t                frames[1];
+} sheet_t;
+
+typedef struct sheet_cell_t {
+    const char              *pixels;
+    int                     w, h, pitch, spans;
+} sheet_cell_t;
+
+
+/*----------------------------------------------------------------------------*/
+#define MAP_META            "ltro_map"
+#define MAP_TILES           255
+
+typedef struct tilemap_t {
+    int                     w, h;
+    int                     count;
+    sprite_t                *tiles[MAP_TILES + 1];
+    Uint8                   cells[1];
+} tilemap_t;
+
+
+/*----------------------------------------------------------------------------*/
+typedef struct layer_t {
+    SDL_Surface             *surface;
+    int                     key;
+    int                     ox, oy;
+} layer_t;
+
+
+/*----------------------------------------------------------------------------*/
+#define GRID_META           "ltro_grid"
+#define GRID_BOX_CELLS      64
+#define GRID_LIMIT          (1 << 29)
+
+typedef struct grid_box_t {
+    lua_Integer             id;
+    int                     x, y, w, h;
+} grid_box_t;
+
+typedef struct grid_t {
+    int                     cell;
+    int                     count, capacity;
+    grid_box_t              *boxes;
+    Uint32                  *stamps;
+    Uint32                  stamp;
+    int                     map_size;
+    int                     *map;
+    int                     dirty;
+    int                     bucket_count, item_capacity;
+    int                     *buckets;
+    int                     *items;
+    int                     large_count;
+    int                     *large;
+} grid_t;
+
+
+/*----------------------------------------------------------------------------*/
+#define PARTICLES_META      "ltro_particles"
+#define PARTICLES_PI        3.14159265f
+
+typedef struct particles_t {
+    int                     capacity, stride, count;
+    float                   gx, gy;
+    Uint32                  seed;
+    float                   *x, *y, *vx, *vy, *life;
+    Uint8                   *color;
+} particles_t;
+
+
+/*----------------------------------------------------------------------------*/
+#define CANVAS_META         "ltro_canvas"
+#define CANVAS_TARGET       "ltro_target"
+
+
 /*----------------------------------------------------------------------------*/
 enum { LTRO_QUIT, LTRO_LUA, LTRO_SPRITE_EDITOR };
 
@@ -309,28 +491,88 @@ static const int            pixeldecoder[256] = {
 */
 /*----------------------------------------------------------------------------*/
 static int                  ltro_mode = LTRO_LUA;
-static Uint32               last_tick;
-static double               delta_ticks = 0.0;
+static Uint64               tick_base;
+static Uint64               tick_count;
+static Uint64               last_present = 0;
+static double               frame_time = 0.0;
+static double               frame_jitter = 0.0, frame_jitter_max = 0.0;
+static double               jitter_sum = 0.0, jitter_max = 0.0;
+static int                  jitter_frames = 0;
+static int                  max_catchup = FPS_CATCHUP;
+static lua_Integer          skipped_draws = 0;
+static lua_Integer          dropped_ticks = 0;
 static lua_Integer          frame_counter = 0;
 static Uint8                btn_down;
 static Uint8                btn_pressed;
 static SDL_Point            mouse;
+static int                  headless = 0;
+static int                  headless_frames = 0;
+
+
+/*----------------------------------------------------------------------------*/
+static int                  replay_mode = REPLAY_OFF;
+static const char           *replay_path = NULL;
+static int                  replay_verify = 0;
+static int                  replay_failed = 0;
+static lua_Integer          replay_seed = 0;
+static Uint32               replay_tick = 0;
+static Uint32               replay_used = 0;
+static replay_run_t         *replay_runs = NULL;
+static int                  replay_run_count = 0, replay_run_capacity = 0, replay_run_index = 0;
+static replay_hash_t        *replay_hashes = NULL;
+static int                  replay_hash_count = 0, replay_hash_capacity = 0, replay_hash_index = 0;
+static int                  replay_checked = 0;
 
 
 /*----------------------------------------------------------------------------*/
 static SDL_Window           *window = NULL;
 static SDL_Renderer         *renderer = NULL;
 static SDL_Texture          *texture = NULL;
-static SDL_Surface          *surface32 = NULL;
 static SDL_Surface          *surface8 = NULL;
+static SDL_Surface          *target = NULL;
+static layer_t              *target_layer = NULL;
+static layer_t              layers[SCREEN_LAYERS];
+static int                  layer_count = 1;
+static int                  layer_current = 0;
+static Uint8                layer_row[SCREEN_WIDTH];
 static int                  clear_color = 0;
 
 
+/*----------------------------------------------------------------------------*/
+static Uint32               present_lut[16];
+static Uint32               *present_memory = NULL;
+static Uint8                present_planes[4][16];
+static void                 (*present_expand)(Uint32 *dst, const Uint8 *src, int n);
+static Uint8                glyph_masks[256][8][8];
+static Uint32               dirty_tiles[SCREEN_TILES_Y];
+static int                  present_bytes = 0;
+static int                  present_tiles = 0;
+static double               present_time = 0.0;
+
+
 /*----------------------------------------------------------------------------*/
 static SDL_AudioDeviceID    audio_device = 0;
 static float                audio_gain = 1.0f;
 static float                audio_frequency;
+static Uint32               audio_steps[88];
 static audio_voice_t        audio_voices[AUDIO_VOICES];
+static float                audio_mix_gain = 1.0f;
+static audio_command_t      audio_commands[AUDIO_COMMANDS];
+static SDL_atomic_t         audio_command_head, audio_command_tail;
+static mml_song_t           *audio_retired[AUDIO_COMMANDS];
+static SDL_atomic_t         audio_retired_head, audio_retired_tail;
+static SDL_atomic_t         audio_latency, audio_latency_max;
+static int                  audio_dropped = 0;
+static SDL_atomic_t         audio_levels[AUDIO_VOICES];
+static voice_slot_t         voice_slots[AUDIO_VOICES];
+static int                  voice_count = AUDIO_MUSIC_VOICES + AUDIO_POOL_VOICES;
+static int                  voice_music = AUDIO_MUSIC_VOICES;
+static int                  voice_policy = VOICE_OLDEST;
+
+
+/*----------------------------------------------------------------------------*/
+static pool_block_t         *pool_blocks[POOL_CLASSES];
+static pool_chunk_t         *pool_chunks = NULL;
 
 
 /*
@@ -345,6 +587,10 @@ static audio_voice_t        audio_voices[AUDIO_VOICES];
 #define maximum(a, b)       ((a) > (b) ? (a) : (b))
 #define clamp(x, min, max)  maximum(minimum(x, max), min)
 #define swap(T, a, b)       do { T __tmp = a; a = b; b = __tmp; } while (0)
+#define floor_div(a, b)     ((a) >= 0 ? (a) / (b) : -((-(a) + (b) - 1) / (b)))
+// GCC -O2 only vectorizes loops without a scalar tail, so run the body over a multiple of 8 first
+#define vector_for(i, n, ...) \
+    do { for (i = 0; i < ((n) & ~7); ++i) { __VA_ARGS__; } for (; i < (n); ++i) { __VA_ARGS__; } } while (0)
 
 
 /*----------------------------------------------------------------------------*/
@@ -362,6 +608,14 @@ static int push_callback(lua_State *L, const char *name) {
 }
 
 
+/*----------------------------------------------------------------------------*/
+static int has_callback(lua_State *L, const char *name) {
+    if (!push_callback(L, name)) return 0;
+    lua_pop(L, 1);
+    return 1;
+}
+
+
 /*----------------------------------------------------------------------------*/
 static Uint8 check_button(lua_State *L, const int n) {
     static const char       *names[] = { "up", "down", "left", "right", "a", "b", "start", NULL };
@@ -373,192 +627,278 @@ static Uint8 check_button(lua_State *L, const int n) {
 /*----------------------------------------------------------------------------*/
 static audio_voice_t* check_voice(lua_State *L, const int n) {
     int                     i = (int)luaL_checkinteger(L, n);
-    luaL_argcheck(L, i >= 1 && i <= AUDIO_VOICES, n, "invalid audio voice");
+    luaL_argcheck(L, i >= 1 && i <= voice_count, n, "invalid audio voice");
     return &audio_voices[i - 1];
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void render_screen(lua_State *L) {
-    const SDL_Color         *color = &palette[clear_color];
+static int pool_class(size_t size) {
+    int                     shift = POOL_MIN_SHIFT;
 
-    if (SDL_SetRenderDrawColor(renderer, color->r, color->g, color->b, 255))
-        luaL_error(L, "SDL_SetRenderDrawColor() failed: %s", SDL_GetError());
-    if (SDL_RenderClear(renderer))
-        luaL_error(L, "SDL_RenderClear() failed: %s", SDL_GetError());
-    if (SDL_BlitSurface(surface8, NULL, surface32, NULL))
-        luaL_error(L, "SDL_BlitSurface() failed: %s", SDL_GetError());
-    if (SDL_UpdateTexture(texture, NULL, surface32->pixels, surface32->pitch))
-        luaL_error(L, "SDL_UpdateTexture() failed: %s", SDL_GetError());
-    if (SDL_RenderCopy(renderer, texture, NULL, NULL))
-        luaL_error(L, "SDL_RenderCopy() failed: %s", SDL_GetError());
-    SDL_RenderPresent(renderer);
+    while (((size_t)1 << shift) < size) ++shift;
+    return shift;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void draw_pixel(int x, int y, Uint8 color) {
-    if ((surface8 != NULL) && (x >= 0) && (x < surface8->w) && (y >= 0) && (y < surface8->h)) {
-        ((Uint8*)surface8->pixels)[surface8->pitch * y + x] = color;
+static void* pool_alloc(size_t size) {
+    int                     shift = pool_class(size);
+    size_t                  offset, block_size = (size_t)1 << shift;
+    pool_chunk_t            *chunk;
+    pool_block_t            *block;
+
+    // large blocks are not pooled at all
+    if (shift > POOL_MAX_SHIFT) return SDL_malloc(size);
+
+    // carve a fresh chunk into blocks of this size class
+    if (pool_blocks[shift - POOL_MIN_SHIFT] == NULL) {
+        if ((chunk = SDL_malloc(POOL_CHUNK_SIZE)) == NULL) return NULL;
+        chunk->next = pool_chunks;
+        pool_chunks = chunk;
+        for (offset = 16; offset + block_size <= POOL_CHUNK_SIZE; offset += block_size) {
+            block = (pool_block_t*)((Uint8*)chunk + offset);
+            block->next = pool_blocks[shift - POOL_MIN_SHIFT];
+            pool_blocks[shift - POOL_MIN_SHIFT] = block;
+        }
     }
+
+    block = pool_blocks[shift - POOL_MIN_SHIFT];
+    pool_blocks[shift - POOL_MIN_SHIFT] = block->next;
+    return block;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void draw_line(int x0, int y0, int x1, int y1, Uint8 color) {
-    int                     dx =  abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
-    int                     dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
-    int                     err = dx + dy, e2;
+static void pool_free(void *ptr, size_t size) {
+    int                     shift = pool_class(size);
+    pool_block_t            *block = ptr;
 
-    color = clamp(color, 0, 9);
-    for (;;) {
-        draw_pixel(x0, y0, color);
-        if (x0 == x1 && y0 == y1) break;
-        e2 = err * 2;
-        if (e2 > dy) { err += dy; x0 += sx; }
-        if (e2 < dx) { err += dx; y0 += sy; }
+    if (ptr == NULL) return;
+    if (shift > POOL_MAX_SHIFT) {
+        SDL_free(ptr);
+    } else {
+        block->next = pool_blocks[shift - POOL_MIN_SHIFT];
+        pool_blocks[shift - POOL_MIN_SHIFT] = block;
     }
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void draw_rect(int x0, int y0, int x1, int y1, Uint8 color, int fill) {
-    int                     x, y;
-
-    if (x0 > x1) swap(int, x0, x1);
-    if (y0 > y1) swap(int, y0, y1);
-    color = clamp(color, 0, 9);
-
-    if (fill) {
-        for (y = y0; y <= y1; ++y) {
-            for (x = x0; x <= x1; ++x) draw_pixel(x, y, color);
-        }
-    } else {
-        for (x = x0; x <= x1; ++x) {
-            draw_pixel(x, y0, color);
-            draw_pixel(x, y1, color);
-        }
-        for (y = y0; y <= y1; ++y) {
-            draw_pixel(x0, y, color);
-            draw_pixel(x1, y, color);
+static int sprite_count_spans(const char *pixels, int pitch, int w, int h, int mask) {
+    int                     x, y, spans = 0;
+    const char              *row;
+
+    for (y = 0; y < h; ++y) {
+        for (x = 0, row = pixels + y * pitch; x < w; ) {
+            for (; x < w && pixeldecoder[(Uint8)row[x]] == mask; ++x);
+            if (x < w) ++spans;
+            for (; x < w && pixeldecoder[(Uint8)row[x]] != mask; ++x);
         }
     }
+    return spans;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void draw_text(int x0, int y0, Uint8 color, const char *text) {
-    int                     x, y, bits;
+static size_t sprite_data_size(int w, int h, int spans) {
+    size_t                  size = sizeof(int) * (h + 1) + sizeof(image_span_t) * spans + w * h;
 
-    color = clamp(color, 0, 9);
-    for (; *text; ++text, x0 += 8) {
-        for (y = 0; y < 8; ++y) {
-            bits = font8x8[((Uint8)*text) * 8 + y];
-            for (x = 0; x < 8; ++x) {
-                if (bits & (1 << x))
-                    draw_pixel(x0 + x, y0 + y, color);
-            }
+    // keep the rows of the next sprite in a sheet aligned
+    return (size + sizeof(int) - 1) & ~(sizeof(int) - 1);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void sprite_decode(sprite_t *sprite, void *data, const char *pixels, int pitch, int w, int h, int spans, int mask) {
+    int                     x, y, x0;
+    image_span_t            *span;
+    const char              *row;
+
+    sprite->w = w;
+    sprite->h = h;
+    SDL_zero(sprite->variants);
+    sprite->bits = NULL;
+    sprite->rows = data;
+    sprite->spans = (image_span_t*)(sprite->rows + h + 1);
+    sprite->pixels = (Uint8*)(sprite->spans + spans);
+
+    // decode pixels and record the opaque runs of every row
+    for (y = 0, span = sprite->spans; y < h; ++y) {
+        sprite->rows[y] = (int)(span - sprite->spans);
+        for (x = 0, row = pixels + y * pitch; x < w; ++x) sprite->pixels[y * w + x] = pixeldecoder[(Uint8)row[x]];
+        for (x = 0; x < w; ) {
+            for (; x < w && sprite->pixels[y * w + x] == mask; ++x);
+            if (x >= w) break;
+            for (x0 = x; x < w && sprite->pixels[y * w + x] != mask; ++x);
+            span->x = (Uint16)x0;
+            span->w = (Uint16)(x - x0);
+            ++span;
         }
     }
+    sprite->rows[h] = (int)(span - sprite->spans);
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void draw_image(int x0, int y0, const char *pixels) {
-    int                     x, y, w, h;
+static sprite_t* sprite_create(const char *pixels, int pitch, int w, int h, int mask) {
+    int                     spans;
+    size_t                  size;
+    sprite_t                *sprite;
+
+    // count the opaque runs first, so we allocate exactly one block
+    spans = sprite_count_spans(pixels, pitch, w, h, mask);
+    size = sizeof(sprite_t) + sprite_data_size(w, h, spans);
+    if ((sprite = pool_alloc(size)) == NULL) return NULL;
+    sprite->size = size;
+    sprite_decode(sprite, sprite + 1, pixels, pitch, w, h, spans, mask);
+    return sprite;
+}
 
-    w = pixeldecoder[(Uint8)pixels[0]] * 10 + pixeldecoder[(Uint8)pixels[1]];
-    h = pixeldecoder[(Uint8)pixels[2]] * 10 + pixeldecoder[(Uint8)pixels[3]];
-    for (y = 0, pixels += 4; y < h; ++y) {
-        for (x = 0; x < w; ++x, ++pixels) draw_pixel(x0 + x, y0 + y, pixeldecoder[(Uint8)*pixels]);
-    }
+
+/*----------------------------------------------------------------------------*/
+static void sprite_source(const sprite_t *sprite, int mode, int x, int y, int *sx, int *sy) {
+    // rotate clockwise first, then flip the rotated image
+    int                     w = (mode & ROTATE_90) ? sprite->h : sprite->w;
+    int                     h = (mode & ROTATE_90) ? sprite->w : sprite->h;
+
+    if (mode & FLIP_X) x = w - 1 - x;
+    if (mode & FLIP_Y) y = h - 1 - y;
+    if (mode & ROTATE_90)   { *sx = y; *sy = sprite->h - 1 - x; }
+    else                    { *sx = x; *sy = y; }
 }
 
 
 /*----------------------------------------------------------------------------*/
-static int mml_parse_number(audio_voice_t *voice) {
-    int                     value = 0;
+static sprite_t* sprite_variant(sprite_t *sprite, int mode) {
+    int                     x, y, x0, sx, sy, w, h, spans, pass;
+    const image_span_t      *span;
+    image_span_t            *out = NULL;
+    Uint8                   *opaque;
+    sprite_t                *variant = NULL;
+
+    if (mode == 0 || sprite->variants[mode] != NULL) return mode ? sprite->variants[mode] : sprite;
+    w = (mode & ROTATE_90) ? sprite->h : sprite->w;
+    h = (mode & ROTATE_90) ? sprite->w : sprite->h;
+
+    // opaque pixels of the original sprite
+    if ((opaque = SDL_calloc(1, sprite->w * sprite->h + 1)) == NULL) return NULL;
+    for (y = 0; y < sprite->h; ++y) {
+        for (span = sprite->spans + sprite->rows[y]; span < sprite->spans + sprite->rows[y + 1]; ++span)
+            SDL_memset(opaque + y * sprite->w + span->x, 1, span->w);
+    }
 
-    for (; voice->mml && *voice->mml; ++voice->mml) {
-        if (*voice->mml >= '0' && *voice->mml <= '9') {
-            value = (value * 10) + (*voice->mml - '0');
-        } else {
-            break;
+    // first pass counts the spans, second pass fills the new sprite
+    for (pass = 0, spans = 0; pass < 2; ++pass) {
+        if (pass == 1) {
+            if ((variant = pool_alloc(sizeof(sprite_t) + sprite_data_size(w, h, spans))) == NULL) break;
+            variant->w = w;
+            variant->h = h;
+            variant->size = sizeof(sprite_t) + sprite_data_size(w, h, spans);
+            SDL_zero(variant->variants);
+            variant->bits = NULL;
+            variant->rows = (int*)(variant + 1);
+            variant->spans = (image_span_t*)(variant->rows + h + 1);
+            variant->pixels = (Uint8*)(variant->spans + spans);
+            out = variant->spans;
+        }
+        for (y = 0; y < h; ++y) {
+            if (pass == 1) variant->rows[y] = (int)(out - variant->spans);
+            for (x = 0; x < w; ) {
+                for (; x < w; ++x) {
+                    sprite_source(sprite, mode, x, y, &sx, &sy);
+                    if (opaque[sy * sprite->w + sx]) break;
+                }
+                if (x >= w) break;
+                for (x0 = x; x < w; ++x) {
+                    sprite_source(sprite, mode, x, y, &sx, &sy);
+                    if (!opaque[sy * sprite->w + sx]) break;
+                    if (pass == 1) variant->pixels[y * w + x] = sprite->pixels[sy * sprite->w + sx];
+                }
+                if (pass == 0) {
+                    ++spans;
+                } else {
+                    out->x = (Uint16)x0;
+                    out->w = (Uint16)(x - x0);
+                    ++out;
+                }
+            }
         }
+        if (pass == 1) variant->rows[h] = (int)(out - variant->spans);
     }
 
-    return value;
+    SDL_free(opaque);
+    return sprite->variants[mode] = variant;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void mml_parse_mode(audio_voice_t *voice) {
-    if (!*voice->mml) return;
-    switch (*voice->mml) {
-        case '5': voice->psg = PSG_50; break;
-        case '2': voice->psg = PSG_25; break;
-        case '1': voice->psg = PSG_12; break;
+static Uint64* sprite_bits(sprite_t *sprite) {
+    int                     x, y, words = (sprite->w + 63) / 64;
+    const image_span_t      *span;
+    Uint64                  *row;
+
+    if (sprite->bits != NULL) return sprite->bits;
+    if ((sprite->bits = pool_alloc(sizeof(Uint64) * words * sprite->h)) == NULL) return NULL;
+
+    // one bit per opaque pixel, the lowest bit is the leftmost pixel
+    SDL_memset(sprite->bits, 0, sizeof(Uint64) * words * sprite->h);
+    for (y = 0, row = sprite->bits; y < sprite->h; ++y, row += words) {
+        for (span = sprite->spans + sprite->rows[y]; span < sprite->spans + sprite->rows[y + 1]; ++span) {
+            for (x = span->x; x < span->x + span->w; ++x) row[x >> 6] |= (Uint64)1 << (x & 63);
+        }
     }
+    return sprite->bits;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void mml_parse_note(audio_voice_t *voice, int key) {
-    int                     tmp;
-    float                   length;
+static void sprite_free_caches(sprite_t *sprite) {
+    int                     i;
 
-    // if not a pause check note modifiers
-    if (key) {
-        if (*voice->mml == '+' || *voice->mml == '#')   { ++key; ++voice->mml; }
-        else if (*voice->mml == '-')                    { --key; ++voice->mml; }
-        key += voice->octave * 12;
-        key = clamp(key, 1, 88);
-    }
-    // check for length and length modifiers
-    if ((tmp = mml_parse_number(voice)))    { length = 1.0f / (float)tmp; }
-    else                                    { length = voice->length; }
-    while (*voice->mml == '.')              { length *= 1.5f; ++voice->mml; }
-    voice->ttl = (int)(length * voice->tempo);
-    // setup note playback
-    if (key) {
-        voice->t0 = 0;
-        voice->t1 = (int)(audio_frequency / frequencies[key]);
-        voice->e0 = 1.0f;
-        voice->e1 = 1.0f / (float)voice->ttl;
-        switch (voice->psg) {
-            case PSG_50: voice->t2 = voice->t1 / 2; break;
-            case PSG_25: voice->t2 = voice->t1 / 4; break;
-            case PSG_12: voice->t2 = voice->t1 / 8; break;
+    for (i = 1; i < 8; ++i) {
+        if (sprite->variants[i] != NULL) {
+            sprite_free_caches(sprite->variants[i]);
+            pool_free(sprite->variants[i], sprite->variants[i]->size);
         }
-    } else {
-        voice->t0 = voice->t1 = 0;
-        voice->e0 = voice->e1 = 0.0f;
+        sprite->variants[i] = NULL;
     }
+    if (sprite->bits != NULL) pool_free(sprite->bits, sizeof(Uint64) * ((sprite->w + 63) / 64) * sprite->h);
+    sprite->bits = NULL;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static int mml_parse_next(audio_voice_t *voice) {
-    int                     tmp;
+static Uint64 fetch_bits(const Uint64 *row, int words, int offset) {
+    // 64 bits starting at any bit offset, zero outside of the row
+    int                     q = floor_div(offset, 64), r = offset - q * 64;
+    Uint64                  lo = (q >= 0 && q < words) ? row[q] : 0;
+    Uint64                  hi = (q + 1 >= 0 && q + 1 < words) ? row[q + 1] : 0;
+
+    return r ? (lo >> r) | (hi << (64 - r)) : lo;
+}
+
 
-    while (voice->mml && *voice->mml) {
-        switch (*voice->mml++) {
-            case ':': voice->mml = voice->song; break;
-            case '<': if (voice->octave > 0) --voice->octave; break;
-            case '>': if (voice->octave < 7) ++voice->octave; break;
-            case 'o': case 'O': tmp = mml_parse_number(voice); voice->octave = clamp(tmp, 0, 6); break;
-            case 'l': case 'L': tmp = mml_parse_number(voice); voice->length = 1.0f / clamp(tmp, 1, 64); break;
-            case 't': case 'T': tmp = mml_parse_number(voice); voice->tempo = 60.0f / (clamp(tmp, 32, 200) / 4) * audio_frequency; break;
-            case 'm': case 'M': mml_parse_mode(voice); break;
-            case 'p': case 'P': mml_parse_note(voice, 0); return 1;
-            case 'r': case 'R': mml_parse_note(voice, 0); return 1;
-            case 'c': case 'C': mml_parse_note(voice, 4); return 1;
-            case 'd': case 'D': mml_parse_note(voice, 6); return 1;
-            case 'e': case 'E': mml_parse_note(voice, 8); return 1;
-            case 'f': case 'F': mml_parse_note(voice, 9); return 1;
-            case 'g': case 'G': mml_parse_note(voice, 11); return 1;
-            case 'a': case 'A': mml_parse_note(voice, 13); return 1;
-            case 'b': case 'B': mml_parse_note(voice, 15); return 1;
+/*----------------------------------------------------------------------------*/
+static int sprites_overlap(lua_State *L, sprite_t *a, int xa, int ya, sprite_t *b, int xb, int yb) {
+    int                     y, k, k0, k1, y0, y1, wa, wb;
+    const Uint64            *ba, *bb;
+
+    // bounding boxes first, most pairs are far apart
+    if (xa >= xb + b->w || xb >= xa + a->w || ya >= yb + b->h || yb >= ya + a->h) return 0;
+    if ((ba = sprite_bits(a)) == NULL || (bb = sprite_bits(b)) == NULL)
+        luaL_error(L, "out of memory for sprite collision masks");
+
+    // only the words of a which overlap b horizontally
+    wa = (a->w + 63) / 64;
+    wb = (b->w + 63) / 64;
+    k0 = (maximum(xa, xb) - xa) >> 6;
+    k1 = (minimum(xa + a->w, xb + b->w) - 1 - xa) >> 6;
+    y0 = maximum(ya, yb);
+    y1 = minimum(ya + a->h, yb + b->h);
+    for (y = y0; y < y1; ++y) {
+        for (k = k0; k <= k1; ++k) {
+            if (ba[(y - ya) * wa + k] & fetch_bits(bb + (y - yb) * wb, wb, k * 64 + xa - xb)) return 1;
         }
     }
     return 0;
@@ -566,261 +906,2541 @@ static int mml_parse_next(audio_voice_t *voice) {
 
 
 /*----------------------------------------------------------------------------*/
-static void mix_audio_voices(void *userdata, Uint8 *stream8, int len8) {
-    float                   *stream = (float*)stream8;
-    int                     i, j, len = len8 / sizeof(float);
-    float                   total, sample;
-    audio_voice_t           *voice;
-
-    (void)userdata;
-    // generate all samples for this callback
-    for (i = 0; i < len; ++i) {
-        total = 0.0f;
-
-        // iterate over all voices
-        for (j = 0; j < AUDIO_VOICES; ++j) {
-            voice = &audio_voices[j];
-            if (voice->ttl > 0) {
-                --voice->ttl;
-                if (++voice->t0 >= voice->t1) voice->t0 = 0;
-                sample = (voice->t0 < voice->t2) ? 1.0f : -1.0f;
-                voice->e0 -= voice->e1;
-                total += sample * 0.125f * voice->e0;
-            } else {
-                mml_parse_next(voice);
-            }
+static const char* check_image(lua_State *L, const int n, int *w, int *h, int *pitch) {
+    int                     x;
+    size_t                  length;
+    const char              *pixels = luaL_checklstring(L, n, &length);
+    const char              *line, *end = pixels + length;
+
+    // images with several lines are not limited by the two digit header
+    for (line = pixels; line < end && *line != '\n'; ++line);
+    if (line < end) {
+        *pitch = (int)(line - pixels) + 1;
+        *w = *pitch - 1 - (*pitch > 1 && pixels[*pitch - 2] == '\r');
+        for (*h = 0, line = pixels; line < end; line += *pitch, ++*h) {
+            for (x = 0; x < *w && line + x < end && line[x] != '\n'; ++x);
+            luaL_argcheck(L, x == *w && (end - line == *w || (end - line >= *pitch && line[*pitch - 1] == '\n')),
+                          n, "image rows must have the same width");
         }
-
-        total *= audio_gain;
-        *stream++ = clamp(total, -1.0f, 1.0f);
+        luaL_argcheck(L, *w > 0 && *w <= 65535, n, "invalid image width");
+        return pixels;
     }
+
+    luaL_argcheck(L, length >= 4, n, "pixel string too small");
+    *w = pixeldecoder[(Uint8)pixels[0]] * 10 + pixeldecoder[(Uint8)pixels[1]];
+    *h = pixeldecoder[(Uint8)pixels[2]] * 10 + pixeldecoder[(Uint8)pixels[3]];
+    *pitch = *w;
+    luaL_argcheck(L, (int)length >= 4 + *w * *h, n, "pixel string too small");
+    return pixels + 4;
 }
 
 
-/*
-================================================================================
+/*----------------------------------------------------------------------------*/
+static sprite_t* check_sprite(lua_State *L, const int n) {
+    sprite_t                **sprite = luaL_checkudata(L, n, SPRITE_META);
+    luaL_argcheck(L, *sprite != NULL, n, "sprite already freed");
+    return *sprite;
+}
 
-        LUA API
 
-================================================================================
-*/
 /*----------------------------------------------------------------------------*/
-static int f_quit(lua_State *L) {
-    (void)L;
-    ltro_mode = LTRO_QUIT;
-    return 0;
+static sheet_t* check_sheet(lua_State *L, const int n) {
+    sheet_t                 **sheet = luaL_checkudata(L, n, SHEET_META);
+    luaL_argcheck(L, *sheet != NULL, n, "sheet already freed");
+    return *sheet;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static int f_btn(lua_State *L) {
-    Uint8                   mask = check_button(L, 1);
-
-    lua_pushboolean(L, btn_down & mask);
-    return 1;
+static int check_flip(lua_State *L, const int n) {
+    const char              *mode = luaL_optstring(L, n, "");
+    int                     flip = 0;
+
+    for (; *mode; ++mode) {
+        switch (*mode) {
+            case 'x': flip |= FLIP_X; break;
+            case 'y': flip |= FLIP_Y; break;
+            case 'r': flip |= ROTATE_90; break;
+            default: luaL_argerror(L, n, "invalid flip mode");
+        }
+    }
+    return flip;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static int f_btnp(lua_State *L) {
-    Uint8                   mask = check_button(L, 1);
+static void expand_pixels_scalar(Uint32 *dst, const Uint8 *src, int n) {
+    int                     i;
 
-    lua_pushboolean(L, btn_pressed & mask);
-    return 1;
+    for (i = 0; i < n; ++i) dst[i] = present_lut[src[i] & 15];
 }
 
 
+#ifdef LTRO_SIMD_X86
 /*----------------------------------------------------------------------------*/
-static int f_clearcolor(lua_State *L) {
-    if (lua_gettop(L) > 0) {
-        lua_Integer color = (int)luaL_checkinteger(L, 1);
-        clear_color = clamp(color, 0, 9);
+__attribute__((target("ssse3")))
+static void expand_pixels_ssse3(Uint32 *dst, const Uint8 *src, int n) {
+    __m128i                 p0 = _mm_loadu_si128((const __m128i*)present_planes[0]);
+    __m128i                 p1 = _mm_loadu_si128((const __m128i*)present_planes[1]);
+    __m128i                 p2 = _mm_loadu_si128((const __m128i*)present_planes[2]);
+    __m128i                 p3 = _mm_loadu_si128((const __m128i*)present_planes[3]);
+    __m128i                 idx, b0, b1, b2, b3, lo01, hi01, lo23, hi23;
+    int                     i;
+
+    // look up every byte of the 32-bit colors with pshufb and interleave them
+    for (i = 0; i + 16 <= n; i += 16) {
+        idx = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + i)), _mm_set1_epi8(15));
+        b0 = _mm_shuffle_epi8(p0, idx); b1 = _mm_shuffle_epi8(p1, idx);
+        b2 = _mm_shuffle_epi8(p2, idx); b3 = _mm_shuffle_epi8(p3, idx);
+        lo01 = _mm_unpacklo_epi8(b0, b1); hi01 = _mm_unpackhi_epi8(b0, b1);
+        lo23 = _mm_unpacklo_epi8(b2, b3); hi23 = _mm_unpackhi_epi8(b2, b3);
+        _mm_storeu_si128((__m128i*)(dst + i +  0), _mm_unpacklo_epi16(lo01, lo23));
+        _mm_storeu_si128((__m128i*)(dst + i +  4), _mm_unpackhi_epi16(lo01, lo23));
+        _mm_storeu_si128((__m128i*)(dst + i +  8), _mm_unpacklo_epi16(hi01, hi23));
+        _mm_storeu_si128((__m128i*)(dst + i + 12), _mm_unpackhi_epi16(hi01, hi23));
     }
-    lua_pushinteger(L, clear_color);
-    return 1;
+    expand_pixels_scalar(dst + i, src + i, n - i);
 }
 
 
 /*----------------------------------------------------------------------------*/
-static int f_clear(lua_State *L) {
-    Uint8                   color = (Uint8)luaL_optinteger(L, 1, clear_color);
-
-    if (surface8 != NULL)
-        SDL_FillRect(surface8, NULL, clamp(color, 0, 9));
-    return 0;
+__attribute__((target("avx2")))
+static void expand_pixels_avx2(Uint32 *dst, const Uint8 *src, int n) {
+    __m256i                 p0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)present_planes[0]));
+    __m256i                 p1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)present_planes[1]));
+    __m256i                 p2 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)present_planes[2]));
+    __m256i                 p3 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)present_planes[3]));
+    __m256i                 idx, b0, b1, b2, b3, lo01, hi01, lo23, hi23, c0, c1, c2, c3;
+    int                     i;
+
+    // same as SSSE3, the unpacks work per 128-bit lane so fix the order on store
+    for (i = 0; i + 32 <= n; i += 32) {
+        idx = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(src + i)), _mm256_set1_epi8(15));
+        b0 = _mm256_shuffle_epi8(p0, idx); b1 = _mm256_shuffle_epi8(p1, idx);
+        b2 = _mm256_shuffle_epi8(p2, idx); b3 = _mm256_shuffle_epi8(p3, idx);
+        lo01 = _mm256_unpacklo_epi8(b0, b1); hi01 = _mm256_unpackhi_epi8(b0, b1);
+        lo23 = _mm256_unpacklo_epi8(b2, b3); hi23 = _mm256_unpackhi_epi8(b2, b3);
+        c0 = _mm256_unpacklo_epi16(lo01, lo23); c1 = _mm256_unpackhi_epi16(lo01, lo23);
+        c2 = _mm256_unpacklo_epi16(hi01, hi23); c3 = _mm256_unpackhi_epi16(hi01, hi23);
+        _mm256_storeu_si256((__m256i*)(dst + i +  0), _mm256_permute2x128_si256(c0, c1, 0x20));
+        _mm256_storeu_si256((__m256i*)(dst + i +  8), _mm256_permute2x128_si256(c2, c3, 0x20));
+        _mm256_storeu_si256((__m256i*)(dst + i + 16), _mm256_permute2x128_si256(c0, c1, 0x31));
+        _mm256_storeu_si256((__m256i*)(dst + i + 24), _mm256_permute2x128_si256(c2, c3, 0x31));
+    }
+    _mm256_zeroupper(); // avoid the AVX/SSE transition penalty in the tail
+    expand_pixels_ssse3(dst + i, src + i, n - i);
 }
+#endif /* LTRO_SIMD_X86 */
 
 
+#ifdef LTRO_SIMD_NEON
 /*----------------------------------------------------------------------------*/
-static int f_pixel(lua_State *L) {
-    Uint8                   color = (Uint8)luaL_checkinteger(L, 1);
-    int                     x0 = (int)luaL_checknumber(L, 2);
-    int                     y0 = (int)luaL_checknumber(L, 3);
-
-    draw_pixel(x0, y0, clamp(color, 0, 9));
-    return 0;
+static void expand_pixels_neon(Uint32 *dst, const Uint8 *src, int n) {
+    uint8x16_t              p0 = vld1q_u8(present_planes[0]);
+    uint8x16_t              p1 = vld1q_u8(present_planes[1]);
+    uint8x16_t              p2 = vld1q_u8(present_planes[2]);
+    uint8x16_t              p3 = vld1q_u8(present_planes[3]);
+    uint8x16_t              idx;
+    uint8x16x4_t            out;
+    int                     i;
+
+    // table lookup per color byte, vst4 does the interleaving for us
+    for (i = 0; i + 16 <= n; i += 16) {
+        idx = vandq_u8(vld1q_u8(src + i), vdupq_n_u8(15));
+        out.val[0] = vqtbl1q_u8(p0, idx);
+        out.val[1] = vqtbl1q_u8(p1, idx);
+        out.val[2] = vqtbl1q_u8(p2, idx);
+        out.val[3] = vqtbl1q_u8(p3, idx);
+        vst4q_u8((Uint8*)(dst + i), out);
+    }
+    expand_pixels_scalar(dst + i, src + i, n - i);
 }
+#endif /* LTRO_SIMD_NEON */
 
 
 /*----------------------------------------------------------------------------*/
-static int f_line(lua_State *L) {
-    Uint8                   color = (Uint8)luaL_checkinteger(L, 1);
-    int                     x0 = (int)luaL_checknumber(L, 2);
-    int                     y0 = (int)luaL_checknumber(L, 3);
-    int                     x1 = (int)luaL_checknumber(L, 4);
-    int                     y1 = (int)luaL_checknumber(L, 5);
+static void init_present(lua_State *L, Uint32 pixel_format) {
+    SDL_PixelFormat         *format;
+    int                     i, j;
+
+    // precompute the 32-bit texture colors of the palette
+    if ((format = SDL_AllocFormat(pixel_format)) == NULL)
+        luaL_error(L, "SDL_AllocFormat() failed: %s", SDL_GetError());
+    SDL_zero(present_lut);
+    for (i = 0; i < 10; ++i) present_lut[i] = SDL_MapRGBA(format, palette[i].r, palette[i].g, palette[i].b, palette[i].a);
+    SDL_FreeFormat(format);
+    for (i = 0; i < 16; ++i) {
+        for (j = 0; j < 4; ++j) present_planes[j][i] = ((const Uint8*)&present_lut[i])[j];
+    }
 
-    draw_line(x0, y0, x1, y1, color);
-    return 0;
+    // pick the fastest expansion kernel of this CPU
+    present_expand = expand_pixels_scalar;
+    #if defined(LTRO_SIMD_X86)
+        if (SDL_HasSSSE3()) present_expand = expand_pixels_ssse3;
+        if (SDL_HasSSSE3() && SDL_HasAVX2()) present_expand = expand_pixels_avx2;
+    #elif defined(LTRO_SIMD_NEON)
+        present_expand = expand_pixels_neon;
+    #endif
 }
 
 
 /*----------------------------------------------------------------------------*/
-static int f_rect(lua_State *L) {
-    Uint8                   color = (Uint8)luaL_checkinteger(L, 1);
-    int                     x0 = (int)luaL_checknumber(L, 2);
-    int                     y0 = (int)luaL_checknumber(L, 3);
-    int                     x1 = (int)luaL_checknumber(L, 4);
-    int                     y1 = (int)luaL_checknumber(L, 5);
-    int                     fill = lua_toboolean(L, 6);
+static void mark_screen(int x0, int y0, int x1, int y1) {
+    Uint32                  bits;
 
-    draw_rect(x0, y0, x1, y1, color, fill);
-    return 0;
+    // inclusive pixel rectangle, clipped to the screen
+    x0 = maximum(x0, 0); x1 = minimum(x1, SCREEN_WIDTH - 1);
+    y0 = maximum(y0, 0); y1 = minimum(y1, SCREEN_HEIGHT - 1);
+    if (x0 > x1 || y0 > y1) return;
+
+    x0 /= SCREEN_TILE; x1 /= SCREEN_TILE;
+    bits = ((2u << x1) - 1) & ~((1u << x0) - 1);
+    for (y0 /= SCREEN_TILE, y1 /= SCREEN_TILE; y0 <= y1; ++y0) dirty_tiles[y0] |= bits;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static int f_circle(lua_State *L) {
-    Uint8                   color = (Uint8)luaL_checkinteger(L, 1);
-    int                     x0 = (int)luaL_checknumber(L, 2);
-    int                     y0 = (int)luaL_checknumber(L, 3);
-    int                     radius = (int)luaL_checknumber(L, 4);
-    int                     fill = lua_toboolean(L, 5);
-    int                     r0sq = fill ? 0 : ((radius - 1) * (radius - 1));
-    int                     r1sq = radius * radius;
-    int                     x, y, dx, dy, dist;
-
-    color = clamp(color, 0, 9);
-    for (y = -radius; y <= radius; ++y) {
-        dy = y * y;
-        for (x = -radius; x <= radius; ++x) {
-            dx = x * x;
-            dist = dx + dy;
-            if ((dist >= r0sq) && (dist <= r1sq))
-                draw_pixel(x0 + x, y0 + y, color);
-        }
-    }
-    return 0;
+static int layers_composited() {
+    // the sprite editor always shows the plain bottom layer
+    return ltro_mode == LTRO_LUA && (layer_count > 1 || layers[0].ox || layers[0].oy);
 }
 
 
 /*----------------------------------------------------------------------------*/
-static int f_print(lua_State *L) {
-    Uint8                   color = (Uint8)luaL_checkinteger(L, 1);
-    int                     x0 = (int)luaL_checknumber(L, 2);
-    int                     y0 = (int)luaL_checknumber(L, 3);
-    const char              *text = luaL_checkstring(L, 4);
+static void mark_dirty(int x0, int y0, int x1, int y1) {
+    // drawing into a canvas does not touch the screen
+    if (target_layer == NULL) return;
+    if (!layers_composited()) {
+        mark_screen(x0, y0, x1, y1);
+        return;
+    }
 
-    draw_text(x0, y0, color, text);
-    return 0;
+    // layer pixels show up moved by the layer offset and wrap around the screen
+    x0 = maximum(x0, 0); x1 = minimum(x1, SCREEN_WIDTH - 1);
+    y0 = maximum(y0, 0); y1 = minimum(y1, SCREEN_HEIGHT - 1);
+    if (x0 > x1 || y0 > y1) return;
+    x0 -= target_layer->ox; x1 -= target_layer->ox;
+    y0 -= target_layer->oy; y1 -= target_layer->oy;
+    if (x0 < 0) { x0 += SCREEN_WIDTH; x1 += SCREEN_WIDTH; }
+    if (y0 < 0) { y0 += SCREEN_HEIGHT; y1 += SCREEN_HEIGHT; }
+    mark_screen(x0, y0, x1, y1);
+    mark_screen(x0 - SCREEN_WIDTH, y0, x1 - SCREEN_WIDTH, y1);
+    mark_screen(x0, y0 - SCREEN_HEIGHT, x1, y1 - SCREEN_HEIGHT);
+    mark_screen(x0 - SCREEN_WIDTH, y0 - SCREEN_HEIGHT, x1 - SCREEN_WIDTH, y1 - SCREEN_HEIGHT);
 }
 
 
 /*----------------------------------------------------------------------------*/
-static int f_draw(lua_State *L) {
-    int                     x, y, w, h, color;
-    size_t                  length;
-    const Uint8             *pixels = (const Uint8*)luaL_checklstring(L, 1, &length);
-    int                     x0 = (int)luaL_checknumber(L, 2);
-    int                     y0 = (int)luaL_checknumber(L, 3);
-    int                     mask = (int)luaL_optinteger(L, 4, 255);
-
-    luaL_argcheck(L, length >= 4, 1, "pixel string too small");
-    w = pixeldecoder[pixels[0]] * 10 + pixeldecoder[pixels[1]];
-    h = pixeldecoder[pixels[2]] * 10 + pixeldecoder[pixels[3]];
-    luaL_argcheck(L, (int)length >= 4 + w * h, 1, "pixel string too small");
-
-    for (y = 0, pixels += 4; y < h; ++y) {
-        for (x = 0; x < w; ++x, ++pixels) {
-            color = pixeldecoder[*pixels];
-            if (color != mask)
-                draw_pixel(x0 + x, y0 + y, color);
-        }
-    }
-
-    return 0;
+static void mark_all_dirty() {
+    // the whole screen, whatever the current target is
+    mark_screen(0, 0, SCREEN_WIDTH - 1, SCREEN_HEIGHT - 1);
 }
 
 
 /*----------------------------------------------------------------------------*/
-static int f_gain(lua_State *L) {
-    if (lua_gettop(L) > 0) {
-        lua_Number          gain = luaL_checknumber(L, 1);
-
-        SDL_LockAudioDevice(audio_device);
-        audio_gain = clamp(gain, 0.0, 1.0);
-        SDL_UnlockAudioDevice(audio_device);
-    }
+static void compose_span(Uint8 *dst, const Uint8 *src, int n, int key) {
+    int                     i;
 
-    lua_pushnumber(L, audio_gain);
-    return 1;
+    if (key < 0)    SDL_memcpy(dst, src, n);
+    else            for (i = 0; i < n; ++i) dst[i] = src[i] != key ? src[i] : dst[i];
 }
 
 
 /*----------------------------------------------------------------------------*/
-static int f_play(lua_State *L) {
-    size_t                  length;
-    audio_voice_t           *voice = check_voice(L, 1);
-    const char              *song = luaL_checklstring(L, 2, &length);
-
-    luaL_argcheck(L, length > 0 && length < sizeof(voice->song), 2, "invalid length of MML string");
-    SDL_LockAudioDevice(audio_device);
-    SDL_strlcpy(voice->song, song, sizeof(voice->song));
-    voice->psg = PSG_50;
-    voice->ttl = 0;
-    voice->mml = voice->song;
-    voice->octave = 3;
-    voice->tempo = 60.0f / (120.0f / 4.0f) * audio_frequency;
-    voice->length = 1.0f / 4.0f;
-    SDL_UnlockAudioDevice(audio_device);
-    return 0;
+static const Uint8* compose_row(int x, int y, int w) {
+    int                     i, n, lx, ly;
+    const layer_t           *layer;
+    const Uint8             *src;
+
+    if (!layers_composited()) return (const Uint8*)surface8->pixels + surface8->pitch * y + x;
+
+    // merge all layers bottom up, every layer wraps around at its offset
+    for (i = 0, layer = layers; i < layer_count; ++i, ++layer) {
+        lx = (x + layer->ox) % SCREEN_WIDTH;
+        ly = (y + layer->oy) % SCREEN_HEIGHT;
+        src = (const Uint8*)layer->surface->pixels + layer->surface->pitch * ly;
+        n = minimum(w, SCREEN_WIDTH - lx);
+        compose_span(layer_row, src + lx, n, i ? layer->key : -1);
+        compose_span(layer_row + n, src, w - n, i ? layer->key : -1);
+    }
+    return layer_row;
 }
 
 
 /*----------------------------------------------------------------------------*/
-static int f_stop(lua_State *L) {
-    audio_voice_t           *voice = check_voice(L, 1);
-
-    SDL_LockAudioDevice(audio_device);
-    voice->ttl = 0;
-    voice->mml = NULL;
-    SDL_UnlockAudioDevice(audio_device);
-    return 0;
+static void upload_rect(lua_State *L, int x, int y, int w, int h) {
+    SDL_Rect                rect;
+    void                    *pixels;
+    int                     pitch;
+
+    rect.x = x; rect.y = y; rect.w = w; rect.h = h;
+    if (texture == NULL) {
+        // headless, expand into the memory framebuffer instead
+        pixels = present_memory + y * SCREEN_WIDTH + x;
+        pitch = SCREEN_WIDTH * sizeof(Uint32);
+    } else if (SDL_LockTexture(texture, &rect, &pixels, &pitch)) {
+        luaL_error(L, "SDL_LockTexture() failed: %s", SDL_GetError());
+    }
+    for (; h > 0; --h, ++y, pixels = (Uint8*)pixels + pitch)
+        present_expand(pixels, compose_row(x, y, w), w);
+    if (texture != NULL) SDL_UnlockTexture(texture);
+    present_bytes += rect.w * rect.h * ((layers_composited() ? layer_count : 1) + 4);
 }
 
 
 /*----------------------------------------------------------------------------*/
-static const luaL_Reg       funcs[] = {
-    { "quit",               f_quit          },
-    { "btn",                f_btn           },
-    { "btnp",               f_btnp          },
-    { "clearcolor",         f_clearcolor    },
-    { "clear",              f_clear         },
+static void render_screen(lua_State *L) {
+    const SDL_Color         *color = &palette[clear_color];
+    Uint64                  start = SDL_GetPerformanceCounter();
+    Uint32                  bits;
+    int                     x0, x1, y0, y1;
+
+    // upload only the dirty tiles, one rectangle per band of equal tile rows
+    present_bytes = present_tiles = 0;
+    for (y0 = 0; y0 < SCREEN_TILES_Y; y0 = y1) {
+        bits = dirty_tiles[y0];
+        for (y1 = y0 + 1; y1 < SCREEN_TILES_Y && dirty_tiles[y1] == bits; ++y1);
+        if (bits == 0) continue;
+        for (x0 = 0; !(bits & (1u << x0)); ++x0);
+        for (x1 = SCREEN_TILES_X - 1; !(bits & (1u << x1)); --x1);
+        for (; bits; bits &= bits - 1) present_tiles += y1 - y0;
+        upload_rect(L, x0 * SCREEN_TILE, y0 * SCREEN_TILE,
+                    minimum((x1 + 1) * SCREEN_TILE, SCREEN_WIDTH) - x0 * SCREEN_TILE,
+                    minimum(y1 * SCREEN_TILE, SCREEN_HEIGHT) - y0 * SCREEN_TILE);
+    }
+    SDL_zero(dirty_tiles);
+    present_time = (double)(SDL_GetPerformanceCounter() - start) * 1000.0 / (double)SDL_GetPerformanceFrequency();
+
+    if (renderer == NULL) return;
+    if (SDL_SetRenderDrawColor(renderer, color->r, color->g, color->b, 255))
+        luaL_error(L, "SDL_SetRenderDrawColor() failed: %s", SDL_GetError());
+    if (SDL_RenderClear(renderer))
+        luaL_error(L, "SDL_RenderClear() failed: %s", SDL_GetError());
+    if (SDL_RenderCopy(renderer, texture, NULL, NULL))
+        luaL_error(L, "SDL_RenderCopy() failed: %s", SDL_GetError());
+    SDL_RenderPresent(renderer);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void select_layer(int n) {
+    layer_current = n;
+    target_layer = &layers[n];
+    target = target_layer->surface;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void draw_pixel(int x, int y, Uint8 color) {
+    if ((target != NULL) && (x >= 0) && (x < target->w) && (y >= 0) && (y < target->h)) {
+        ((Uint8*)target->pixels)[target->pitch * y + x] = color;
+        mark_dirty(x, y, x, y);
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void draw_hline(int x0, int x1, int y, Uint8 color) {
+    if ((target == NULL) || (y < 0) || (y >= target->h)) return;
+    x0 = maximum(x0, 0);
+    x1 = minimum(x1, target->w - 1);
+    if (x0 > x1) return;
+    SDL_memset((Uint8*)target->pixels + target->pitch * y + x0, color, x1 - x0 + 1);
+    mark_dirty(x0, y, x1, y);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void draw_vline(int x, int y0, int y1, Uint8 color) {
+    Uint8                   *dst;
+
+    if ((target == NULL) || (x < 0) || (x >= target->w)) return;
+    y0 = maximum(y0, 0);
+    y1 = minimum(y1, target->h - 1);
+    mark_dirty(x, y0, x, y1);
+    for (dst = (Uint8*)target->pixels + target->pitch * y0 + x; y0 <= y1; ++y0, dst += target->pitch) *dst = color;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static Sint64 line_minor_steps(Sint64 i, Sint64 major, Sint64 minor) {
+    // closed form of how often draw_line() stepped the minor axis after i steps
+    Uint64                  p = (Uint64)minor * (Uint64)i;
+    return (Sint64)(p / (Uint64)major + ((p % (Uint64)major) * 2 > (Uint64)major));
+}
+
+
+/*----------------------------------------------------------------------------*/
+static Sint64 line_search(Sint64 n, Sint64 major, Sint64 minor, Sint64 k) {
+    Sint64                  lo = 0, hi = n + 1, mid;
+
+    // first step in [0, n] with at least k minor steps, n + 1 if there is none
+    if (k <= 0) return 0;
+    if (k > minor) return n + 1;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (line_minor_steps(mid, major, minor) >= k) hi = mid; else lo = mid + 1;
+    }
+    return lo;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void line_axis_range(int p, int s, int size, Sint64 *k0, Sint64 *k1) {
+    // steps for which p + s * k stays inside [0, size - 1]
+    if (s > 0)  { *k0 = -(Sint64)p; *k1 = (Sint64)size - 1 - p; }
+    else        { *k0 = (Sint64)p - (size - 1); *k1 = p; }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void draw_line(int x0, int y0, int x1, int y1, Uint8 color) {
+    Sint64                  dx, dy, err, e2, i, i0, i1, n, kx, ky;
+    Sint64                  kx0, kx1, ky0, ky1;
+    int                     sx, sy, pitch;
+    Uint8                   *pixels;
+
+    if (target == NULL) return;
+    color = clamp(color, 0, 9);
+
+    // axis aligned lines are plain spans
+    if (y0 == y1) { draw_hline(minimum(x0, x1), maximum(x0, x1), y0, color); return; }
+    if (x0 == x1) { draw_vline(x0, minimum(y0, y1), maximum(y0, y1), color); return; }
+
+    dx = (Sint64)x1 - x0; sx = dx > 0 ? 1 : -1; dx *= sx;
+    dy = (Sint64)y1 - y0; sy = dy > 0 ? 1 : -1; dy *= sy;
+    line_axis_range(x0, sx, target->w, &kx0, &kx1);
+    line_axis_range(y0, sy, target->h, &ky0, &ky1);
+
+    // find the visible steps without walking the invisible ones
+    if (dx >= dy) {
+        n = dx;
+        i0 = maximum(maximum(kx0, 0), line_search(n, dx, dy, ky0));
+        i1 = minimum(minimum(kx1, n), line_search(n, dx, dy, ky1 + 1) - 1);
+    } else {
+        n = dy;
+        i0 = maximum(maximum(ky0, 0), line_search(n, dy, dx, kx0));
+        i1 = minimum(minimum(ky1, n), line_search(n, dy, dx, kx1 + 1) - 1);
+    }
+    if (i0 > i1) return;
+
+    // resume the Bresenham walk at the first visible step
+    kx = (dx >= dy) ? i0 : line_minor_steps(i0, dy, dx);
+    ky = (dx >= dy) ? line_minor_steps(i0, dx, dy) : i0;
+    err = (Sint64)((Uint64)dx - (Uint64)dy - (Uint64)kx * (Uint64)dy + (Uint64)ky * (Uint64)dx);
+    pitch = target->pitch * sy;
+    pixels = (Uint8*)target->pixels + target->pitch * (y0 + sy * ky) + (x0 + sx * kx);
+    x1 = x0 + sx * (int)((dx >= dy) ? i1 : line_minor_steps(i1, dy, dx));
+    y1 = y0 + sy * (int)((dx >= dy) ? line_minor_steps(i1, dx, dy) : i1);
+    x0 += sx * (int)kx; y0 += sy * (int)ky;
+    mark_dirty(minimum(x0, x1), minimum(y0, y1), maximum(x0, x1), maximum(y0, y1));
+    for (i = i0; ; ++i) {
+        *pixels = color;
+        if (i == i1) break;
+        e2 = err * 2;
+        if (e2 > -dy) { err -= dy; pixels += sx; }
+        if (e2 < dx) { err += dx; pixels += pitch; }
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void draw_rect(int x0, int y0, int x1, int y1, Uint8 color, int fill) {
+    int                     y;
+
+    if (x0 > x1) swap(int, x0, x1);
+    if (y0 > y1) swap(int, y0, y1);
+    color = clamp(color, 0, 9);
+
+    if (fill) {
+        if (target == NULL) return;
+        for (y = maximum(y0, 0); y <= minimum(y1, target->h - 1); ++y) draw_hline(x0, x1, y, color);
+    } else {
+        draw_hline(x0, x1, y0, color);
+        draw_hline(x0, x1, y1, color);
+        draw_vline(x0, y0, y1, color);
+        draw_vline(x1, y0, y1, color);
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static Sint64 isqrt(Sint64 n) {
+    Sint64                  x;
+
+    if (n <= 0) return 0;
+    x = (Sint64)SDL_sqrt((double)n);
+    while (x * x > n) --x;
+    while ((x + 1) * (x + 1) <= n) ++x;
+    return x;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void draw_circle(int x0, int y0, int radius, Uint8 color, int fill) {
+    Sint64                  r0sq = fill ? 0 : ((Sint64)(radius - 1) * (radius - 1));
+    Sint64                  r1sq = (Sint64)radius * radius;
+    Sint64                  xo, xi, left, right;
+    int                     y, ys, ye;
+
+    if (target == NULL || radius < 0) return;
+    color = clamp(color, 0, 9);
+
+    // only visit the visible rows, every row is one or two spans of the ring
+    ys = (int)maximum(-(Sint64)radius, -(Sint64)y0);
+    ye = (int)minimum((Sint64)radius, (Sint64)target->h - 1 - y0);
+    for (y = ys; y <= ye; ++y) {
+        xo = isqrt(r1sq - (Sint64)y * y);
+        xi = (r0sq - (Sint64)y * y > 0) ? isqrt(r0sq - (Sint64)y * y - 1) : -1;
+        left = clamp(x0 - xo, -1, (Sint64)target->w);
+        right = clamp(x0 + xo, -1, (Sint64)target->w);
+        if (xi < 0) {
+            draw_hline((int)left, (int)right, y0 + y, color);
+        } else {
+            draw_hline((int)left, (int)clamp(x0 - xi - 1, -1, (Sint64)target->w), y0 + y, color);
+            draw_hline((int)clamp(x0 + xi + 1, -1, (Sint64)target->w), (int)right, y0 + y, color);
+        }
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void init_glyphs() {
+    int                     i, x, y;
+
+    // expand every bit of the font into a 0x00 / 0xff byte mask
+    for (i = 0; i < 256; ++i) {
+        for (y = 0; y < 8; ++y) {
+            for (x = 0; x < 8; ++x) glyph_masks[i][y][x] = (font8x8[i * 8 + y] & (1 << x)) ? 0xff : 0x00;
+        }
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void draw_text(int x0, int y0, Uint8 color, const char *text) {
+    int                     x, y, ys, ye, xs, xe, first;
+    Uint64                  mask, pixels, fill;
+    const Uint8             *glyph;
+    Uint8                   *dst;
+
+    if (target == NULL || y0 >= target->h || y0 <= -8) return;
+    color = clamp(color, 0, 9);
+    fill = (Uint64)0x0101010101010101 * color;
+
+    // clip the rows once for the whole string and skip glyphs left of the screen
+    ys = maximum(0, -y0);
+    ye = minimum(8, target->h - y0);
+    for (; *text && x0 <= -8; ++text, x0 += 8);
+    for (first = x0; *text && x0 < target->w; ++text, x0 += 8) {
+        if (x0 >= 0 && x0 + 8 <= target->w) {
+            // whole glyph visible, one masked 8 byte store per row
+            dst = (Uint8*)target->pixels + target->pitch * (y0 + ys) + x0;
+            for (y = ys; y < ye; ++y, dst += target->pitch) {
+                SDL_memcpy(&mask, glyph_masks[(Uint8)*text][y], 8);
+                if (mask == 0) continue;
+                SDL_memcpy(&pixels, dst, 8);
+                pixels = (pixels & ~mask) | (fill & mask);
+                SDL_memcpy(dst, &pixels, 8);
+            }
+        } else {
+            // clip the columns first, so the row pointer never points before the pixels
+            xs = maximum(0, -x0);
+            xe = minimum(8, target->w - x0);
+            dst = (Uint8*)target->pixels + target->pitch * (y0 + ys) + x0 + xs;
+            for (y = ys; y < ye; ++y, dst += target->pitch) {
+                glyph = glyph_masks[(Uint8)*text][y];
+                for (x = xs; x < xe; ++x) dst[x - xs] = (dst[x - xs] & ~glyph[x]) | (color & glyph[x]);
+            }
+        }
+    }
+    if (x0 > first) mark_dirty(first, y0 + ys, x0 - 1, y0 + ye - 1);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void draw_image(int x0, int y0, const char *pixels) {
+    int                     x, y, w, h;
+
+    w = pixeldecoder[(Uint8)pixels[0]] * 10 + pixeldecoder[(Uint8)pixels[1]];
+    h = pixeldecoder[(Uint8)pixels[2]] * 10 + pixeldecoder[(Uint8)pixels[3]];
+    for (y = 0, pixels += 4; y < h; ++y) {
+        for (x = 0; x < w; ++x, ++pixels) draw_pixel(x0 + x, y0 + y, pixeldecoder[(Uint8)*pixels]);
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void draw_sprite(sprite_t *sprite, int x0, int y0, int flip) {
+    int                     y, ys, ye, xa, xb, clipped;
+    const image_span_t      *span, *end;
+    const Uint8             *src;
+    Uint8                   *dst;
+
+    // transformed sprites are built once and cached
+    if (target == NULL || (sprite = sprite_variant(sprite, flip)) == NULL) return;
+    if (x0 >= target->w || y0 >= target->h || x0 + sprite->w <= 0 || y0 + sprite->h <= 0) return;
+
+    // clip once against the screen
+    ys = maximum(0, -y0);
+    ye = minimum(sprite->h, target->h - y0);
+    clipped = (x0 < 0) || (x0 + sprite->w > target->w);
+    mark_dirty(x0, y0 + ys, x0 + sprite->w - 1, y0 + ye - 1);
+
+    for (y = ys; y < ye; ++y) {
+        src = sprite->pixels + y * sprite->w;
+        dst = (Uint8*)target->pixels + target->pitch * (y0 + y) + x0;
+        span = sprite->spans + sprite->rows[y];
+        end = sprite->spans + sprite->rows[y + 1];
+        if (!clipped) {
+            for (; span < end; ++span) SDL_memcpy(dst + span->x, src + span->x, span->w);
+        } else {
+            for (; span < end; ++span) {
+                xa = maximum(span->x, -x0);
+                xb = minimum(span->x + span->w, target->w - x0);
+                if (xa < xb) SDL_memcpy(dst + xa, src + xa, xb - xa);
+            }
+        }
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void draw_map(const tilemap_t *map, int x0, int y0) {
+    int                     x, y, xs, xe, ys, ye, tw, th;
+    const Uint8             *cells;
+
+    if (target == NULL || map->count < 1) return;
+    tw = map->tiles[1]->w;
+    th = map->tiles[1]->h;
+    if (tw < 1 || th < 1) return;
+
+    // only visit the cells inside the visible window
+    xs = maximum(0, floor_div(-x0, tw));
+    xe = minimum(map->w - 1, floor_div(target->w - 1 - x0, tw));
+    ys = maximum(0, floor_div(-y0, th));
+    ye = minimum(map->h - 1, floor_div(target->h - 1 - y0, th));
+    for (y = ys; y <= ye; ++y) {
+        cells = map->cells + y * map->w;
+        for (x = xs; x <= xe; ++x) {
+            if (cells[x] && cells[x] <= map->count)
+                draw_sprite(map->tiles[cells[x]], x0 + x * tw, y0 + y * th, 0);
+        }
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void draw_canvas(const SDL_Surface *canvas, int x0, int y0, int key) {
+    int                     x, y, xs, xe, ys, ye;
+    const Uint8             *src;
+    Uint8                   *dst;
+
+    if (target == NULL) return;
+
+    // clip once against the target
+    xs = maximum(0, -x0); xe = minimum(canvas->w, target->w - x0);
+    ys = maximum(0, -y0); ye = minimum(canvas->h, target->h - y0);
+    if (xs >= xe || ys >= ye) return;
+    mark_dirty(x0 + xs, y0 + ys, x0 + xe - 1, y0 + ye - 1);
+
+    for (y = ys; y < ye; ++y) {
+        src = (const Uint8*)canvas->pixels + canvas->pitch * y;
+        dst = (Uint8*)target->pixels + target->pitch * (y0 + y) + x0;
+        if (key < 0 || key > 255)   SDL_memcpy(dst + xs, src + xs, xe - xs);
+        else                        for (x = xs; x < xe; ++x) if (src[x] != key) dst[x] = src[x];
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int scroll_target(int dx, int dy, int rects[2][4]) {
+    int                     y, ys, ye, step, w, h, n = 0;
+    Uint8                   *pixels;
+
+    if (target == NULL || (dx == 0 && dy == 0)) return 0;
+    w = target->w;
+    h = target->h;
+    pixels = target->pixels;
+    mark_dirty(0, 0, w - 1, h - 1);
+
+    // everything scrolled out, nothing to move
+    if (dx <= -w || dx >= w || dy <= -h || dy >= h) {
+        rects[0][0] = 0; rects[0][1] = 0; rects[0][2] = w - 1; rects[0][3] = h - 1;
+        return 1;
+    }
+
+    // walk against the direction of the move, so no row is overwritten before it was copied
+    if (dy > 0) { ys = h - 1; ye = dy - 1; step = -1; }
+    else        { ys = 0; ye = h + dy; step = 1; }
+    for (y = ys; y != ye; y += step) {
+        SDL_memmove(pixels + target->pitch * y + maximum(dx, 0),
+                    pixels + target->pitch * (y - dy) + maximum(-dx, 0), w - SDL_abs(dx));
+    }
+
+    // exposed column strip over the full height, then the row strip beside it
+    if (dx != 0) {
+        rects[n][0] = dx > 0 ? 0 : w + dx; rects[n][1] = 0;
+        rects[n][2] = dx > 0 ? dx - 1 : w - 1; rects[n][3] = h - 1;
+        ++n;
+    }
+    if (dy != 0) {
+        rects[n][0] = maximum(dx, 0); rects[n][1] = dy > 0 ? 0 : h + dy;
+        rects[n][2] = w - 1 + minimum(dx, 0); rects[n][3] = dy > 0 ? dy - 1 : h - 1;
+        ++n;
+    }
+    return n;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void init_audio_steps() {
+    int                     i;
+
+    // phase increment per sample for every note at the actual output rate
+    for (i = 0; i < 88; ++i)
+        audio_steps[i] = (Uint32)((double)frequencies[i] / audio_frequency * 4294967296.0 + 0.5);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int mml_parse_number(const char **mml) {
+    int                     value = 0;
+
+    for (; **mml >= '0' && **mml <= '9'; ++*mml) {
+        if (value < 100000) value = (value * 10) + (**mml - '0');
+    }
+
+    return value;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void mml_parse_note(mml_state_t *state, const char **mml, int key, mml_event_t *event) {
+    int                     tmp;
+    float                   length;
+
+    // if not a pause check note modifiers
+    if (key) {
+        if (**mml == '+' || **mml == '#')   { ++key; ++*mml; }
+        else if (**mml == '-')              { --key; ++*mml; }
+        key += state->octave * 12;
+        key = clamp(key, 1, 87);
+    }
+    // check for length and length modifiers
+    if ((tmp = mml_parse_number(mml)))      { length = 1.0f / (float)tmp; }
+    else                                    { length = state->length; }
+    while (**mml == '.')                    { length *= 1.5f; ++*mml; }
+    if (event == NULL) return;
+    event->ttl = (int)(length * state->tempo);
+    // setup note playback, the duty cycle is a threshold of the 32 bit phase
+    if (key) {
+        event->step = audio_steps[key];
+        event->e1 = 1.0f / (float)event->ttl;
+        switch (state->psg) {
+            case PSG_50: event->duty = 0x80000000u; break;
+            case PSG_25: event->duty = 0x40000000u; break;
+            case PSG_12: event->duty = 0x20000000u; break;
+        }
+    } else {
+        event->step = event->duty = 0;
+        event->e1 = 0.0f;
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int mml_compile_pass(lua_State *L, const char *song, mml_state_t *state, mml_event_t *events, int *loops) {
+    static const int        keys[7] = { 13, 15, 4, 6, 8, 9, 11 };
+    const char              *mml = song;
+    int                     c, tmp, count = 0;
+
+    // everything behind ':' is never played
+    for (*loops = 0; *mml && !*loops;) {
+        switch (c = *mml++) {
+            case ':': *loops = 1; break;
+            case '<': if (state->octave > 0) --state->octave; break;
+            case '>': if (state->octave < 7) ++state->octave; break;
+            case 'o': case 'O': tmp = mml_parse_number(&mml); state->octave = clamp(tmp, 0, 6); break;
+            case 'l': case 'L': tmp = mml_parse_number(&mml); state->length = 1.0f / clamp(tmp, 1, 64); break;
+            case 't': case 'T': tmp = mml_parse_number(&mml); state->tempo = 60.0f / (clamp(tmp, 32, 200) / 4) * audio_frequency; break;
+            case 'm': case 'M':
+                switch (*mml++) {
+                    case '5': state->psg = PSG_50; break;
+                    case '2': state->psg = PSG_25; break;
+                    case '1': state->psg = PSG_12; break;
+                    default: luaL_error(L, "invalid PSG mode at position %d of MML string", (int)(mml - song));
+                }
+                break;
+            case 'p': case 'P': case 'r': case 'R':
+                mml_parse_note(state, &mml, 0, events ? &events[count] : NULL);
+                ++count;
+                break;
+            case 'a': case 'b': case 'c': case 'd': case 'e': case 'f': case 'g':
+            case 'A': case 'B': case 'C': case 'D': case 'E': case 'F': case 'G':
+                mml_parse_note(state, &mml, keys[(c | 0x20) - 'a'], events ? &events[count] : NULL);
+                ++count;
+                break;
+            case '&': case ' ': case '\t': case '\r': case '\n': break;
+            default: luaL_error(L, "unexpected '%c' at position %d of MML string", c, (int)(mml - song));
+        }
+    }
+    return count;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static mml_song_t *mml_compile(lua_State *L, const char *song) {
+    mml_state_t             start, state, passes[MML_PASSES];
+    mml_song_t              *compiled;
+    int                     i, n, loops, count = 0, loop = -1, offsets[MML_PASSES];
+
+    // the state carries over a ':' loop, so unroll until the state at its start repeats
+    start.psg = PSG_50;
+    start.octave = 3;
+    start.tempo = 60.0f / (120.0f / 4.0f) * audio_frequency;
+    start.length = 1.0f / 4.0f;
+    state = start;
+    for (n = 0; n < MML_PASSES; ++n) {
+        passes[n] = state;
+        offsets[n] = count;
+        count += mml_compile_pass(L, song, &state, NULL, &loops);
+        if (!loops) break;
+        for (i = 0; i <= n && SDL_memcmp(&passes[i], &state, sizeof(state)); ++i) ;
+        if (i <= n) { loop = offsets[i]; break; }
+    }
+    if (n >= MML_PASSES)
+        luaL_error(L, "MML loop does not repeat");
+    if (loop >= count) loop = -1; // a loop without notes just ends the song
+
+    if ((compiled = SDL_malloc(sizeof(mml_song_t) + sizeof(mml_event_t) * count)) == NULL)
+        luaL_error(L, "out of memory");
+    compiled->count = count;
+    compiled->loop = loop;
+    for (state = start, count = 0, i = 0; i <= n && i < MML_PASSES; ++i)
+        count += mml_compile_pass(L, song, &state, compiled->events + count, &loops);
+    return compiled;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void mml_next_event(audio_voice_t *voice) {
+    const mml_event_t       *event;
+
+    if (voice->song == NULL) return;
+    if (voice->event >= voice->song->count) {
+        if (voice->song->loop < 0) return;
+        voice->event = voice->song->loop;
+    }
+    event = &voice->song->events[voice->event++];
+    voice->ttl = event->ttl;
+    voice->phase = 0;
+    voice->step = event->step;
+    voice->duty = event->duty;
+    voice->e0 = event->step ? 1.0f : 0.0f;
+    voice->e1 = event->e1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int retire_song(mml_song_t *song) {
+    Uint32                  head = (Uint32)SDL_AtomicGet(&audio_retired_head);
+
+    if (song == NULL) return 1;
+    if (head - (Uint32)SDL_AtomicGet(&audio_retired_tail) >= AUDIO_COMMANDS) return 0;
+    audio_retired[head % AUDIO_COMMANDS] = song;
+    SDL_AtomicSet(&audio_retired_head, (int)(head + 1));
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void run_audio_commands() {
+    Uint32                  tail = (Uint32)SDL_AtomicGet(&audio_command_tail);
+    Uint32                  head = (Uint32)SDL_AtomicGet(&audio_command_head);
+    Uint64                  now = SDL_GetPerformanceCounter();
+    int                     latency;
+    audio_command_t         *command;
+    audio_voice_t           *voice;
+
+    for (; tail != head; ++tail) {
+        command = &audio_commands[tail % AUDIO_COMMANDS];
+        voice = &audio_voices[command->voice];
+        // replaced songs go back to the Lua side, try again next buffer when it lags behind
+        if (command->type != AUDIO_GAIN && !retire_song(voice->song)) break;
+        switch (command->type) {
+            case AUDIO_PLAY:
+            case AUDIO_STOP:
+                voice->song = command->song;
+                voice->event = 0;
+                voice->ttl = 0;
+                break;
+            case AUDIO_GAIN:
+                audio_mix_gain = command->gain;
+                break;
+        }
+        latency = (int)((now - command->sent) * 1000000 / SDL_GetPerformanceFrequency());
+        SDL_AtomicSet(&audio_latency, latency);
+        if (latency > SDL_AtomicGet(&audio_latency_max)) SDL_AtomicSet(&audio_latency_max, latency);
+    }
+    SDL_AtomicSet(&audio_command_tail, (int)tail);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void mix_pulse(float * restrict out, int n, float level, float slope) {
+    int                     i;
+
+    // one sign and a linear envelope over the whole run
+    vector_for(i, n, out[i] += level - slope * (float)(i + 1));
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void mix_voice(audio_voice_t *voice, float *out, int len) {
+    int                     i = 0, n, k;
+    Uint32                  phase;
+    float                   amplitude;
+
+    while (i < len) {
+        if (voice->ttl <= 0) {
+            // idle voices cost nothing, a new note starts with one silent sample
+            if (voice->song == NULL || (voice->event >= voice->song->count && voice->song->loop < 0)) return;
+            mml_next_event(voice);
+            ++i;
+            continue;
+        }
+        n = minimum(voice->ttl, len - i);
+        voice->ttl -= n;
+        if (voice->step == 0) { i += n; continue; } // pause
+
+        // split the run into segments with a constant pulse level, up to the duty threshold or the phase wrap
+        while (n > 0) {
+            phase = voice->phase + voice->step;
+            if (phase < voice->duty)    { k = (int)(((Uint64)voice->duty - phase + voice->step - 1) / voice->step); amplitude = 0.125f; }
+            else                        { k = (int)((((Uint64)1 << 32) - phase + voice->step - 1) / voice->step); amplitude = -0.125f; }
+            k = minimum(k, n);
+            mix_pulse(out + i, k, amplitude * voice->e0, amplitude * voice->e1);
+            voice->e0 -= (float)k * voice->e1;
+            voice->phase = phase + (Uint32)(k - 1) * voice->step;
+            i += k;
+            n -= k;
+        }
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void mix_audio_voices(void *userdata, Uint8 *stream8, int len8) {
+    float                   *stream = (float*)stream8;
+    int                     i, len = len8 / sizeof(float);
+    float                   gain;
+
+    (void)userdata;
+    run_audio_commands();
+
+    // render voice after voice over the whole buffer
+    SDL_memset(stream, 0, len * sizeof(float));
+    for (i = 0; i < AUDIO_VOICES; ++i) {
+        mix_voice(&audio_voices[i], stream, len);
+        // the envelope level lets the Lua side steal the quietest voice
+        SDL_AtomicSet(&audio_levels[i], audio_voices[i].ttl > 0 ? (int)(audio_voices[i].e0 * 65536.0f) : 0);
+    }
+
+    gain = audio_mix_gain;
+    vector_for(i, len, stream[i] = clamp(stream[i] * gain, -1.0f, 1.0f));
+}
+
+
+/*
+================================================================================
+
+        LUA API
+
+================================================================================
+*/
+/*----------------------------------------------------------------------------*/
+static int f_quit(lua_State *L) {
+    (void)L;
+    ltro_mode = LTRO_QUIT;
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_btn(lua_State *L) {
+    Uint8                   mask = check_button(L, 1);
+
+    lua_pushboolean(L, btn_down & mask);
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_btnp(lua_State *L) {
+    Uint8                   mask = check_button(L, 1);
+
+    lua_pushboolean(L, btn_pressed & mask);
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_clearcolor(lua_State *L) {
+    if (lua_gettop(L) > 0) {
+        lua_Integer color = (int)luaL_checkinteger(L, 1);
+        clear_color = clamp(color, 0, 9);
+    }
+    lua_pushinteger(L, clear_color);
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_clear(lua_State *L) {
+    Uint8                   color = (Uint8)luaL_optinteger(L, 1, clear_color);
+
+    if (target != NULL)
+        draw_rect(0, 0, target->w - 1, target->h - 1, color, 1);
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_scroll(lua_State *L) {
+    int                     dx = (int)luaL_checknumber(L, 1);
+    int                     dy = (int)luaL_checknumber(L, 2);
+    int                     fill = lua_isnoneornil(L, 3) ? -1 : (int)clamp(luaL_checkinteger(L, 3), 0, 9);
+    int                     i, j, n, rects[2][4];
+
+    // the fill color has to be read before the results are pushed over argument 3
+    n = scroll_target(dx, dy, rects);
+    for (i = 0; i < n; ++i) {
+        if (fill >= 0) draw_rect(rects[i][0], rects[i][1], rects[i][2], rects[i][3], (Uint8)fill, 1);
+        for (j = 0; j < 4; ++j) lua_pushinteger(L, rects[i][j]);
+    }
+    return n * 4;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_pixel(lua_State *L) {
+    Uint8                   color = (Uint8)luaL_checkinteger(L, 1);
+    int                     x0 = (int)luaL_checknumber(L, 2);
+    int                     y0 = (int)luaL_checknumber(L, 3);
+
+    draw_pixel(x0, y0, clamp(color, 0, 9));
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_line(lua_State *L) {
+    Uint8                   color = (Uint8)luaL_checkinteger(L, 1);
+    int                     x0 = (int)luaL_checknumber(L, 2);
+    int                     y0 = (int)luaL_checknumber(L, 3);
+    int                     x1 = (int)luaL_checknumber(L, 4);
+    int                     y1 = (int)luaL_checknumber(L, 5);
+
+    draw_line(x0, y0, x1, y1, color);
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_lines(lua_State *L) {
+    Uint8                   color = (Uint8)luaL_checkinteger(L, 1);
+    int                     closed = lua_toboolean(L, 3);
+    int                     i, n, x0, y0, x1, y1, xs, ys;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    n = (int)luaL_len(L, 2) / 2;
+    if (n < 1) return 0;
+
+    lua_rawgeti(L, 2, 1); lua_rawgeti(L, 2, 2);
+    xs = x0 = (int)luaL_checknumber(L, -2);
+    ys = y0 = (int)luaL_checknumber(L, -1);
+    lua_pop(L, 2);
+    if (n == 1) draw_line(x0, y0, x0, y0, color);
+
+    for (i = 1; i < n; ++i, x0 = x1, y0 = y1) {
+        lua_rawgeti(L, 2, i * 2 + 1); lua_rawgeti(L, 2, i * 2 + 2);
+        x1 = (int)luaL_checknumber(L, -2);
+        y1 = (int)luaL_checknumber(L, -1);
+        lua_pop(L, 2);
+        draw_line(x0, y0, x1, y1, color);
+    }
+    if (closed && n > 2) draw_line(x0, y0, xs, ys, color);
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_rect(lua_State *L) {
+    Uint8                   color = (Uint8)luaL_checkinteger(L, 1);
+    int                     x0 = (int)luaL_checknumber(L, 2);
+    int                     y0 = (int)luaL_checknumber(L, 3);
+    int                     x1 = (int)luaL_checknumber(L, 4);
+    int                     y1 = (int)luaL_checknumber(L, 5);
+    int                     fill = lua_toboolean(L, 6);
+
+    draw_rect(x0, y0, x1, y1, color, fill);
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_circle(lua_State *L) {
+    Uint8                   color = (Uint8)luaL_checkinteger(L, 1);
+    int                     x0 = (int)luaL_checknumber(L, 2);
+    int                     y0 = (int)luaL_checknumber(L, 3);
+    int                     radius = (int)luaL_checknumber(L, 4);
+    int                     fill = lua_toboolean(L, 5);
+
+    draw_circle(x0, y0, radius, color, fill);
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+enum { BATCH_PIXEL = 1, BATCH_LINE, BATCH_RECT, BATCH_RECTFILL, BATCH_CIRCLE, BATCH_CIRCLEFILL, BATCH_SPRITE, BATCH_OPS };
+
+static const int            batch_args[BATCH_OPS] = { 0, 3, 5, 5, 5, 4, 4, 3 };
+
+static void run_batch_command(lua_State *L, int op, const int *a) {
+    sprite_t                **sprite;
+    Uint8                   color = (Uint8)clamp(a[0], 0, 9);
+
+    switch (op) {
+        case BATCH_PIXEL:       draw_pixel(a[1], a[2], color); break;
+        case BATCH_LINE:        draw_line(a[1], a[2], a[3], a[4], color); break;
+        case BATCH_RECT:        draw_rect(a[1], a[2], a[3], a[4], color, 0); break;
+        case BATCH_RECTFILL:    draw_rect(a[1], a[2], a[3], a[4], color, 1); break;
+        case BATCH_CIRCLE:      draw_circle(a[1], a[2], a[3], color, 0); break;
+        case BATCH_CIRCLEFILL:  draw_circle(a[1], a[2], a[3], color, 1); break;
+        case BATCH_SPRITE:
+            // sprites are looked up by index in the optional second argument
+            if (lua_rawgeti(L, 2, a[0]) == LUA_TUSERDATA && (sprite = luaL_testudata(L, -1, SPRITE_META)) != NULL && *sprite != NULL)
+                draw_sprite(*sprite, a[1], a[2], 0);
+            lua_pop(L, 1);
+            break;
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_batch(lua_State *L) {
+    int                     i, op, pos, n, commands = 0;
+    int                     args[5];
+    size_t                  length;
+    const Uint8             *data;
+
+    if (!lua_isnoneornil(L, 2)) luaL_checktype(L, 2, LUA_TTABLE);
+    else                        { lua_settop(L, 1); lua_newtable(L); }
+
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        // packed stream of little endian int16 values, e.g. string.pack('<hhhh', 1, color, x, y)
+        data = (const Uint8*)lua_tolstring(L, 1, &length);
+        n = (int)(length / 2);
+        for (pos = 0; pos < n; pos += batch_args[op] + 1, ++commands) {
+            op = (Sint16)(data[pos * 2] | data[pos * 2 + 1] << 8);
+            if (op < 1 || op >= BATCH_OPS) return luaL_error(L, "invalid batch command %d at value %d", op, pos + 1);
+            if (pos + batch_args[op] >= n) return luaL_error(L, "truncated batch command at value %d", pos + 1);
+            for (i = 0; i < batch_args[op]; ++i) args[i] = (Sint16)(data[pos * 2 + i * 2 + 2] | data[pos * 2 + i * 2 + 3] << 8);
+            run_batch_command(L, op, args);
+        }
+    } else {
+        // flat array of numbers: op, arg1, arg2, ...
+        luaL_checktype(L, 1, LUA_TTABLE);
+        n = (int)luaL_len(L, 1);
+        for (pos = 1; pos <= n; pos += batch_args[op] + 1, ++commands) {
+            lua_rawgeti(L, 1, pos);
+            op = (int)lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            if (op < 1 || op >= BATCH_OPS) return luaL_error(L, "invalid batch command %d at index %d", op, pos);
+            if (pos + batch_args[op] > n) return luaL_error(L, "truncated batch command at index %d", pos);
+            for (i = 0; i < batch_args[op]; ++i) lua_rawgeti(L, 1, pos + i + 1);
+            for (i = 0; i < batch_args[op]; ++i) args[i] = (int)lua_tonumber(L, i - batch_args[op]);
+            lua_pop(L, batch_args[op]);
+            run_batch_command(L, op, args);
+        }
+    }
+    lua_pushinteger(L, commands);
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_print(lua_State *L) {
+    Uint8                   color = (Uint8)luaL_checkinteger(L, 1);
+    int                     x0 = (int)luaL_checknumber(L, 2);
+    int                     y0 = (int)luaL_checknumber(L, 3);
+    const char              *text = luaL_checkstring(L, 4);
+
+    draw_text(x0, y0, color, text);
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_draw(lua_State *L) {
+    int                     x, y, w, h, color;
+    size_t                  length;
+    const Uint8             *pixels;
+    int                     x0 = (int)luaL_checknumber(L, 2);
+    int                     y0 = (int)luaL_checknumber(L, 3);
+    int                     mask;
+
+    // compiled sprites are already decoded and clipped as spans
+    if (lua_type(L, 1) == LUA_TUSERDATA) {
+        tilemap_t           *map = luaL_testudata(L, 1, MAP_META);
+        SDL_Surface         **canvas = luaL_testudata(L, 1, CANVAS_META);
+        if (map != NULL) {
+            draw_map(map, x0, y0);
+        } else if (canvas != NULL) {
+            luaL_argcheck(L, *canvas != NULL && *canvas != target, 1, "invalid canvas");
+            draw_canvas(*canvas, x0, y0, (int)luaL_optinteger(L, 4, -1));
+        } else {
+            draw_sprite(check_sprite(L, 1), x0, y0, lua_type(L, 4) == LUA_TSTRING ? check_flip(L, 4) : 0);
+        }
+        return 0;
+    }
+
+    mask = (int)luaL_optinteger(L, 4, 255);
+    pixels = (const Uint8*)luaL_checklstring(L, 1, &length);
+    luaL_argcheck(L, length >= 4, 1, "pixel string too small");
+    w = pixeldecoder[pixels[0]] * 10 + pixeldecoder[pixels[1]];
+    h = pixeldecoder[pixels[2]] * 10 + pixeldecoder[pixels[3]];
+    luaL_argcheck(L, (int)length >= 4 + w * h, 1, "pixel string too small");
+
+    for (y = 0, pixels += 4; y < h; ++y) {
+        for (x = 0; x < w; ++x, ++pixels) {
+            color = pixeldecoder[*pixels];
+            if (color != mask)
+                draw_pixel(x0 + x, y0 + y, color);
+        }
+    }
+
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_sprite(lua_State *L) {
+    int                     w, h, pitch;
+    const char              *pixels = check_image(L, 1, &w, &h, &pitch);
+    int                     mask = (int)luaL_optinteger(L, 2, 255);
+    sprite_t                **sprite;
+
+    sprite = lua_newuserdatauv(L, sizeof(sprite_t*), 0);
+    *sprite = NULL;
+    luaL_setmetatable(L, SPRITE_META);
+    if ((*sprite = sprite_create(pixels, pitch, w, h, mask)) == NULL)
+        luaL_error(L, "out of sprite memory");
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_sprite_gc(lua_State *L) {
+    sprite_t                **sprite = luaL_checkudata(L, 1, SPRITE_META);
+
+    if (*sprite != NULL) {
+        sprite_free_caches(*sprite);
+        pool_free(*sprite, (*sprite)->size);
+        *sprite = NULL;
+    }
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_overlap(lua_State *L) {
+    sprite_t                *a = check_sprite(L, 1);
+    int                     xa = (int)luaL_checknumber(L, 2);
+    int                     ya = (int)luaL_checknumber(L, 3);
+    sprite_t                *b = check_sprite(L, 4);
+    int                     xb = (int)luaL_checknumber(L, 5);
+    int                     yb = (int)luaL_checknumber(L, 6);
+
+    lua_pushboolean(L, sprites_overlap(L, a, xa, ya, b, xb, yb));
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_sheet(lua_State *L) {
+    int                     i, x, y, w, h, pitch, count, mask;
+    size_t                  size;
+    const char              *pixels;
+    sheet_cell_t            *cells;
+    sheet_t                 **sheet;
+    Uint8                   *data;
+
+    if (lua_type(L, 1) == LUA_TTABLE) {
+        // many small images packed together
+        mask = (int)luaL_optinteger(L, 2, 255);
+        count = (int)luaL_len(L, 1);
+        luaL_argcheck(L, count > 0, 1, "no images given");
+        cells = lua_newuserdatauv(L, sizeof(sheet_cell_t) * count, 0);
+        for (i = 0; i < count; ++i) {
+            lua_rawgeti(L, 1, i + 1);
+            cells[i].pixels = check_image(L, -1, &cells[i].w, &cells[i].h, &cells[i].pitch);
+            lua_pop(L, 1);
+        }
+    } else {
+        // one big image cut into cells
+        pixels = check_image(L, 1, &w, &h, &pitch);
+        x = (int)luaL_checkinteger(L, 2);
+        y = (int)luaL_checkinteger(L, 3);
+        mask = (int)luaL_optinteger(L, 4, 255);
+        luaL_argcheck(L, x > 0 && x <= w, 2, "invalid cell width");
+        luaL_argcheck(L, y > 0 && y <= h, 3, "invalid cell height");
+        count = (w / x) * (h / y);
+        cells = lua_newuserdatauv(L, sizeof(sheet_cell_t) * count, 0);
+        for (i = 0; i < count; ++i) {
+            cells[i].pixels = pixels + (i / (w / x)) * y * pitch + (i % (w / x)) * x;
+            cells[i].w = x;
+            cells[i].h = y;
+            cells[i].pitch = pitch;
+        }
+    }
+
+    // measure all frames, so the whole sheet is a single block
+    size = sizeof(sheet_t) + sizeof(sprite_t) * (count - 1);
+    for (i = 0; i < count; ++i) {
+        cells[i].spans = sprite_count_spans(cells[i].pixels, cells[i].pitch, cells[i].w, cells[i].h, mask);
+        size += sprite_data_size(cells[i].w, cells[i].h, cells[i].spans);
+    }
+
+    sheet = lua_newuserdatauv(L, sizeof(sheet_t*), 0);
+    *sheet = NULL;
+    luaL_setmetatable(L, SHEET_META);
+    if ((*sheet = pool_alloc(size)) == NULL)
+        luaL_error(L, "out of sprite memory");
+    (*sheet)->count = count;
+    (*sheet)->size = size;
+    data = (Uint8*)&(*sheet)->frames[count];
+    for (i = 0; i < count; ++i) {
+        (*sheet)->frames[i].size = 0;
+        sprite_decode(&(*sheet)->frames[i], data, cells[i].pixels, cells[i].pitch, cells[i].w, cells[i].h, cells[i].spans, mask);
+        data += sprite_data_size(cells[i].w, cells[i].h, cells[i].spans);
+    }
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_sheet_gc(lua_State *L) {
+    sheet_t                 **sheet = luaL_checkudata(L, 1, SHEET_META);
+    int                     i;
+
+    if (*sheet != NULL) {
+        for (i = 0; i < (*sheet)->count; ++i) sprite_free_caches(&(*sheet)->frames[i]);
+        pool_free(*sheet, (*sheet)->size);
+        *sheet = NULL;
+    }
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_sheet_len(lua_State *L) {
+    lua_pushinteger(L, check_sheet(L, 1)->count);
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_spr(lua_State *L) {
+    sheet_t                 *sheet = check_sheet(L, 1);
+    lua_Integer             n = luaL_checkinteger(L, 2);
+    int                     x0 = (int)luaL_checknumber(L, 3);
+    int                     y0 = (int)luaL_checknumber(L, 4);
+    int                     flip = check_flip(L, 5);
+
+    luaL_argcheck(L, n >= 1 && n <= sheet->count, 2, "invalid sprite index");
+    draw_sprite(&sheet->frames[n - 1], x0, y0, flip);
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static SDL_Surface* check_canvas(lua_State *L, const int n) {
+    SDL_Surface             **canvas = luaL_checkudata(L, n, CANVAS_META);
+    luaL_argcheck(L, *canvas != NULL, n, "canvas already freed");
+    return *canvas;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_canvas(lua_State *L) {
+    int                     w = (int)luaL_checkinteger(L, 1);
+    int                     h = (int)luaL_checkinteger(L, 2);
+    SDL_Surface             **canvas;
+
+    luaL_argcheck(L, w >= 1 && w <= 4096, 1, "invalid canvas width");
+    luaL_argcheck(L, h >= 1 && h <= 4096, 2, "invalid canvas height");
+    canvas = lua_newuserdatauv(L, sizeof(SDL_Surface*), 0);
+    *canvas = NULL;
+    luaL_setmetatable(L, CANVAS_META);
+    if ((*canvas = SDL_CreateRGBSurface(0, w, h, 8, 0, 0, 0, 0)) == NULL)
+        luaL_error(L, "SDL_CreateRGBSurface() failed: %s", SDL_GetError());
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_canvas_gc(lua_State *L) {
+    SDL_Surface             **canvas = luaL_checkudata(L, 1, CANVAS_META);
+
+    if (*canvas != NULL) {
+        if (target == *canvas) select_layer(layer_current);
+        SDL_FreeSurface(*canvas);
+        *canvas = NULL;
+    }
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_canvas_size(lua_State *L) {
+    SDL_Surface             *canvas = check_canvas(L, 1);
+
+    lua_pushinteger(L, canvas->w);
+    lua_pushinteger(L, canvas->h);
+    return 2;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_target(lua_State *L) {
+    // keep the canvas alive as long as we draw into it
+    if (lua_isnoneornil(L, 1)) {
+        select_layer(layer_current);
+        lua_pushnil(L);
+    } else {
+        target = check_canvas(L, 1);
+        target_layer = NULL;
+        lua_pushvalue(L, 1);
+    }
+    lua_setfield(L, LUA_REGISTRYINDEX, CANVAS_TARGET);
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_layers(lua_State *L) {
+    int                     count = (int)luaL_optinteger(L, 1, layer_count);
+    SDL_Surface             *surface;
+
+    luaL_argcheck(L, count >= 1 && count <= SCREEN_LAYERS, 1, "invalid number of layers");
+    for (; layer_count < count; ++layer_count) {
+        // new layers are transparent
+        if ((surface = SDL_CreateRGBSurface(0, SCREEN_WIDTH, SCREEN_HEIGHT, 8, 0, 0, 0, 0)) == NULL)
+            luaL_error(L, "SDL_CreateRGBSurface() failed: %s", SDL_GetError());
+        layers[layer_count].surface = surface;
+        layers[layer_count].key = 0;
+        layers[layer_count].ox = layers[layer_count].oy = 0;
+    }
+    for (; layer_count > count; --layer_count) {
+        if (target == layers[layer_count - 1].surface) select_layer(0);
+        SDL_FreeSurface(layers[layer_count - 1].surface);
+        layers[layer_count - 1].surface = NULL;
+    }
+    if (layer_current >= layer_count) layer_current = 0;
+    mark_all_dirty();
+    lua_pushinteger(L, layer_count);
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_layer(lua_State *L) {
+    int                     n = (int)luaL_checkinteger(L, 1) - 1;
+    layer_t                 *layer;
+    int                     ox, oy, key;
+
+    luaL_argcheck(L, n >= 0 && n < layer_count, 1, "invalid layer");
+    layer = &layers[n];
+    ox = (((int)luaL_optinteger(L, 2, layer->ox) % SCREEN_WIDTH) + SCREEN_WIDTH) % SCREEN_WIDTH;
+    oy = (((int)luaL_optinteger(L, 3, layer->oy) % SCREEN_HEIGHT) + SCREEN_HEIGHT) % SCREEN_HEIGHT;
+    key = n ? (int)luaL_optinteger(L, 4, layer->key) : -1;
+
+    // moving a layer changes the whole screen
+    if (ox != layer->ox || oy != layer->oy || key != layer->key) mark_all_dirty();
+    layer->ox = ox;
+    layer->oy = oy;
+    layer->key = key;
+
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, CANVAS_TARGET);
+    select_layer(n);
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void set_map_tiles(lua_State *L, tilemap_t *map, const int n) {
+    sprite_t                *tiles[MAP_TILES + 1];
+    int                     i, count;
+    sheet_t                 *sheet;
+
+    // all frames of a sheet can be used as tiles
+    if (lua_type(L, n) == LUA_TUSERDATA) {
+        sheet = check_sheet(L, n);
+        count = minimum(sheet->count, MAP_TILES);
+        lua_pushvalue(L, n);
+        lua_setiuservalue(L, -2, 1);
+        for (i = 1; i <= count; ++i) map->tiles[i] = &sheet->frames[i - 1];
+        map->count = count;
+        return;
+    }
+
+    luaL_checktype(L, n, LUA_TTABLE);
+    count = (int)luaL_len(L, n);
+    luaL_argcheck(L, count >= 0 && count <= MAP_TILES, n, "too many tiles");
+
+    // keep our own copy of the sprites alive as user value, the map only changes once all of them are valid
+    lua_createtable(L, count, 0);
+    for (i = 1; i <= count; ++i) {
+        lua_rawgeti(L, n, i);
+        tiles[i] = check_sprite(L, -1);
+        lua_rawseti(L, -2, i);
+    }
+    lua_setiuservalue(L, -2, 1);
+    for (i = 1; i <= count; ++i) map->tiles[i] = tiles[i];
+    map->count = count;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void check_map_rect(lua_State *L, tilemap_t *map, const int n, int *x, int *y, int *w, int *h) {
+    *x = (int)luaL_optinteger(L, n + 0, 0);
+    *y = (int)luaL_optinteger(L, n + 1, 0);
+    *w = (int)luaL_optinteger(L, n + 2, map->w - *x);
+    *h = (int)luaL_optinteger(L, n + 3, map->h - *y);
+    luaL_argcheck(L, *x >= 0 && *x < map->w, n + 0, "invalid x position");
+    luaL_argcheck(L, *y >= 0 && *y < map->h, n + 1, "invalid y position");
+    luaL_argcheck(L, *w >= 1 && *x + *w <= map->w, n + 2, "invalid width");
+    luaL_argcheck(L, *h >= 1 && *y + *h <= map->h, n + 3, "invalid height");
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_map(lua_State *L) {
+    int                     w = (int)luaL_checkinteger(L, 1);
+    int                     h = (int)luaL_checkinteger(L, 2);
+    tilemap_t               *map;
+
+    luaL_argcheck(L, w >= 1 && w <= 4096, 1, "invalid map width");
+    luaL_argcheck(L, h >= 1 && h <= 4096, 2, "invalid map height");
+    map = lua_newuserdatauv(L, sizeof(tilemap_t) + w * h, 1);
+    SDL_memset(map, 0, sizeof(tilemap_t) + w * h);
+    map->w = w;
+    map->h = h;
+    luaL_setmetatable(L, MAP_META);
+    if (!lua_isnoneornil(L, 3)) set_map_tiles(L, map, 3);
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_map_tiles(lua_State *L) {
+    tilemap_t               *map = luaL_checkudata(L, 1, MAP_META);
+
+    lua_settop(L, 2);
+    lua_pushvalue(L, 1);
+    set_map_tiles(L, map, 2);
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_map_size(lua_State *L) {
+    tilemap_t               *map = luaL_checkudata(L, 1, MAP_META);
+
+    lua_pushinteger(L, map->w);
+    lua_pushinteger(L, map->h);
+    return 2;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_map_get(lua_State *L) {
+    tilemap_t               *map = luaL_checkudata(L, 1, MAP_META);
+    int                     x = (int)luaL_checkinteger(L, 2);
+    int                     y = (int)luaL_checkinteger(L, 3);
+
+    if (x >= 0 && x < map->w && y >= 0 && y < map->h)
+        lua_pushinteger(L, map->cells[y * map->w + x]);
+    else
+        lua_pushinteger(L, 0);
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_map_set(lua_State *L) {
+    tilemap_t               *map = luaL_checkudata(L, 1, MAP_META);
+    int                     x = (int)luaL_checkinteger(L, 2);
+    int                     y = (int)luaL_checkinteger(L, 3);
+    lua_Integer             tile = luaL_checkinteger(L, 4);
+
+    luaL_argcheck(L, tile >= 0 && tile <= MAP_TILES, 4, "invalid tile");
+    if (x >= 0 && x < map->w && y >= 0 && y < map->h)
+        map->cells[y * map->w + x] = (Uint8)tile;
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_map_load(lua_State *L) {
+    tilemap_t               *map = luaL_checkudata(L, 1, MAP_META);
+    int                     i, n, x, y, w, h;
+    size_t                  length;
+    const char              *data;
+    lua_Integer             tile;
+
+    check_map_rect(L, map, 3, &x, &y, &w, &h);
+    if (lua_type(L, 2) == LUA_TSTRING) {
+        // every byte of the string is one tile
+        data = lua_tolstring(L, 2, &length);
+        n = (int)minimum(length, (size_t)(w * h));
+        for (i = 0; i < n; ++i) map->cells[(y + i / w) * map->w + x + i % w] = (Uint8)data[i];
+    } else {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        n = (int)minimum(luaL_len(L, 2), (lua_Integer)(w * h));
+        for (i = 0; i < n; ++i) {
+            lua_rawgeti(L, 2, i + 1);
+            tile = luaL_checkinteger(L, -1);
+            luaL_argcheck(L, tile >= 0 && tile <= MAP_TILES, 2, "invalid tile");
+            map->cells[(y + i / w) * map->w + x + i % w] = (Uint8)tile;
+            lua_pop(L, 1);
+        }
+    }
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_map_dump(lua_State *L) {
+    tilemap_t               *map = luaL_checkudata(L, 1, MAP_META);
+    int                     x, y, w, h;
+    luaL_Buffer             buffer;
+
+    check_map_rect(L, map, 2, &x, &y, &w, &h);
+    luaL_buffinit(L, &buffer);
+    for (; h > 0; --h, ++y) luaL_addlstring(&buffer, (const char*)map->cells + y * map->w + x, w);
+    luaL_pushresult(&buffer);
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int grid_home(const grid_t *grid, lua_Integer id) {
+    return (int)(((Uint64)id * 0x9E3779B97F4A7C15ull) >> 32) & (grid->map_size - 1);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int grid_find(const grid_t *grid, lua_Integer id) {
+    int                     i;
+
+    // linear probing, map entries are slot + 1 and 0 is empty
+    if (grid->map_size == 0) return -1;
+    for (i = grid_home(grid, id); grid->map[i]; i = (i + 1) & (grid->map_size - 1)) {
+        if (grid->boxes[grid->map[i] - 1].id == id) return i;
+    }
+    return -1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void grid_erase(grid_t *grid, int i) {
+    int                     j, k, mask = grid->map_size - 1;
+
+    // shift the following entries back, so no tombstones are needed
+    for (j = (i + 1) & mask; grid->map[j]; j = (j + 1) & mask) {
+        k = grid_home(grid, grid->boxes[grid->map[j] - 1].id);
+        if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            grid->map[i] = grid->map[j];
+            i = j;
+        }
+    }
+    grid->map[i] = 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void grid_grow(lua_State *L, grid_t *grid) {
+    int                     i, j, capacity = grid->capacity ? grid->capacity * 2 : 64;
+    grid_box_t              *boxes;
+    Uint32                  *stamps;
+    int                     *map;
+
+    if ((boxes = SDL_realloc(grid->boxes, sizeof(grid_box_t) * capacity)) == NULL) luaL_error(L, "out of grid memory");
+    grid->boxes = boxes;
+    if ((stamps = SDL_realloc(grid->stamps, sizeof(Uint32) * capacity)) == NULL) luaL_error(L, "out of grid memory");
+    grid->stamps = stamps;
+    if ((map = SDL_calloc(capacity * 2, sizeof(int))) == NULL) luaL_error(L, "out of grid memory");
+    for (i = grid->count; i < capacity; ++i) grid->stamps[i] = 0;
+
+    // rehash all ids into the bigger map
+    SDL_free(grid->map);
+    grid->map = map;
+    grid->map_size = capacity * 2;
+    grid->capacity = capacity;
+    for (i = 0; i < grid->count; ++i) {
+        for (j = grid_home(grid, grid->boxes[i].id); map[j]; j = (j + 1) & (grid->map_size - 1));
+        map[j] = i + 1;
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int grid_bucket(const grid_t *grid, int cx, int cy) {
+    return (int)(((Uint32)cx * 73856093u) ^ ((Uint32)cy * 19349663u)) & (grid->bucket_count - 1);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static Sint64 grid_cells(const grid_t *grid, const grid_box_t *box) {
+    return (Sint64)(floor_div(box->x + box->w - 1, grid->cell) - floor_div(box->x, grid->cell) + 1) *
+           (Sint64)(floor_div(box->y + box->h - 1, grid->cell) - floor_div(box->y, grid->cell) + 1);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void grid_rebuild(lua_State *L, grid_t *grid) {
+    int                     i, cx, cy, buckets = 16;
+    Sint64                  cells, total = 0;
+    const grid_box_t        *box;
+    int                     *memory;
+
+    if (!grid->dirty) return;
+
+    // every box is stored in all the cells it touches, boxes covering too many cells go to an extra list
+    if ((memory = SDL_realloc(grid->large, sizeof(int) * (grid->count + 1))) == NULL) luaL_error(L, "out of grid memory");
+    grid->large = memory;
+    grid->large_count = 0;
+    for (i = 0, box = grid->boxes; i < grid->count; ++i, ++box) {
+        if ((cells = grid_cells(grid, box)) > GRID_BOX_CELLS) grid->large[grid->large_count++] = i;
+        else total += cells;
+    }
+    if (total > SDL_MAX_SINT32 / 2) luaL_error(L, "too many grid cells");
+    while (buckets < total) buckets *= 2;
+    if (buckets > grid->bucket_count) {
+        if ((memory = SDL_realloc(grid->buckets, sizeof(int) * (buckets + 1))) == NULL) luaL_error(L, "out of grid memory");
+        grid->buckets = memory;
+    }
+    if (total > grid->item_capacity) {
+        if ((memory = SDL_realloc(grid->items, sizeof(int) * total)) == NULL) luaL_error(L, "out of grid memory");
+        grid->items = memory;
+        grid->item_capacity = (int)total;
+    }
+    grid->bucket_count = buckets;
+
+    // count, prefix sum and scatter into one flat array (CSR)
+    SDL_memset(grid->buckets, 0, sizeof(int) * (buckets + 1));
+    for (i = 0, box = grid->boxes; i < grid->count; ++i, ++box) {
+        if (grid_cells(grid, box) > GRID_BOX_CELLS) continue;
+        for (cy = floor_div(box->y, grid->cell); cy <= floor_div(box->y + box->h - 1, grid->cell); ++cy)
+            for (cx = floor_div(box->x, grid->cell); cx <= floor_div(box->x + box->w - 1, grid->cell); ++cx)
+                ++grid->buckets[grid_bucket(grid, cx, cy) + 1];
+    }
+    for (i = 0; i < buckets; ++i) grid->buckets[i + 1] += grid->buckets[i];
+    for (i = 0, box = grid->boxes; i < grid->count; ++i, ++box) {
+        if (grid_cells(grid, box) > GRID_BOX_CELLS) continue;
+        for (cy = floor_div(box->y, grid->cell); cy <= floor_div(box->y + box->h - 1, grid->cell); ++cy)
+            for (cx = floor_div(box->x, grid->cell); cx <= floor_div(box->x + box->w - 1, grid->cell); ++cx)
+                grid->items[grid->buckets[grid_bucket(grid, cx, cy)]++] = i;
+    }
+    for (i = buckets; i > 0; --i) grid->buckets[i] = grid->buckets[i - 1];
+    grid->buckets[0] = 0;
+    grid->dirty = 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void grid_next_stamp(grid_t *grid) {
+    if (++grid->stamp == 0) {
+        SDL_memset(grid->stamps, 0, sizeof(Uint32) * grid->capacity);
+        grid->stamp = 1;
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int grid_query(lua_State *L, grid_t *grid, int x, int y, int w, int h, int skip, int out) {
+    int                     i, j, cx, cy, cx0, cy0, cx1, cy1, n = 0;
+    const grid_box_t        *box;
+
+    grid_rebuild(L, grid);
+    cx0 = floor_div(x, grid->cell); cx1 = floor_div(x + w - 1, grid->cell);
+    cy0 = floor_div(y, grid->cell); cy1 = floor_div(y + h - 1, grid->cell);
+
+    // stamps make sure a box in several cells is reported once
+    grid_next_stamp(grid);
+    if (skip >= 0) grid->stamps[skip] = grid->stamp;
+
+    // huge regions are cheaper to check box by box
+    if ((Sint64)(cx1 - cx0 + 1) * (cy1 - cy0 + 1) > grid->count) {
+        for (i = 0, box = grid->boxes; i < grid->count; ++i, ++box) {
+            if (i == skip || x >= box->x + box->w || box->x >= x + w || y >= box->y + box->h || box->y >= y + h) continue;
+            lua_pushinteger(L, box->id);
+            lua_rawseti(L, out, ++n);
+        }
+        return n;
+    }
+
+    for (cy = cy0; cy <= cy1; ++cy) {
+        for (cx = cx0; cx <= cx1; ++cx) {
+            j = grid_bucket(grid, cx, cy);
+            for (i = grid->buckets[j]; i < grid->buckets[j + 1]; ++i) {
+                box = &grid->boxes[grid->items[i]];
+                if (grid->stamps[grid->items[i]] == grid->stamp) continue;
+                if (x >= box->x + box->w || box->x >= x + w || y >= box->y + box->h || box->y >= y + h) continue;
+                grid->stamps[grid->items[i]] = grid->stamp;
+                lua_pushinteger(L, box->id);
+                lua_rawseti(L, out, ++n);
+            }
+        }
+    }
+
+    // large boxes are not in the cells, so check all of them
+    for (i = 0; i < grid->large_count; ++i) {
+        box = &grid->boxes[grid->large[i]];
+        if (grid->large[i] == skip || x >= box->x + box->w || box->x >= x + w || y >= box->y + box->h || box->y >= y + h) continue;
+        lua_pushinteger(L, box->id);
+        lua_rawseti(L, out, ++n);
+    }
+    return n;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int push_grid_result(lua_State *L, int out, int n) {
+    int                     i;
+
+    // remove what is left over from the last time this table was used
+    for (i = n + 1; lua_rawgeti(L, out, i) != LUA_TNIL; ++i) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+        lua_rawseti(L, out, i);
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, out);
+    lua_pushinteger(L, n);
+    return 2;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int check_grid_out(lua_State *L, int n) {
+    if (lua_isnoneornil(L, n)) {
+        lua_settop(L, n - 1);
+        lua_newtable(L);
+    } else {
+        luaL_checktype(L, n, LUA_TTABLE);
+    }
+    return n;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int check_grid_coord(lua_State *L, int n, int min, int max) {
+    lua_Number              value = luaL_checknumber(L, n);
+
+    // keeps x + w and the cell numbers far away from an int overflow
+    return (int)clamp(value, (lua_Number)min, (lua_Number)max);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_grid(lua_State *L) {
+    int                     cell = (int)luaL_checkinteger(L, 1);
+    grid_t                  *grid;
+
+    luaL_argcheck(L, cell >= 1, 1, "invalid cell size");
+    grid = lua_newuserdatauv(L, sizeof(grid_t), 0);
+    SDL_zerop(grid);
+    grid->cell = cell;
+    luaL_setmetatable(L, GRID_META);
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_grid_gc(lua_State *L) {
+    grid_t                  *grid = luaL_checkudata(L, 1, GRID_META);
+
+    SDL_free(grid->boxes);
+    SDL_free(grid->stamps);
+    SDL_free(grid->map);
+    SDL_free(grid->buckets);
+    SDL_free(grid->items);
+    SDL_free(grid->large);
+    SDL_zerop(grid);
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_grid_len(lua_State *L) {
+    lua_pushinteger(L, ((grid_t*)luaL_checkudata(L, 1, GRID_META))->count);
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_grid_set(lua_State *L) {
+    grid_t                  *grid = luaL_checkudata(L, 1, GRID_META);
+    lua_Integer             id = luaL_checkinteger(L, 2);
+    int                     x = check_grid_coord(L, 3, -GRID_LIMIT, GRID_LIMIT);
+    int                     y = check_grid_coord(L, 4, -GRID_LIMIT, GRID_LIMIT);
+    int                     w = check_grid_coord(L, 5, 1, GRID_LIMIT);
+    int                     h = check_grid_coord(L, 6, 1, GRID_LIMIT);
+    int                     i = grid_find(grid, id);
+    grid_box_t              *box;
+
+    // all arguments are checked before a new box is inserted
+    if (i < 0) {
+        if (grid->count == grid->capacity) grid_grow(L, grid);
+        for (i = grid_home(grid, id); grid->map[i]; i = (i + 1) & (grid->map_size - 1));
+        grid->map[i] = ++grid->count;
+        box = &grid->boxes[grid->count - 1];
+        box->id = id;
+    } else {
+        box = &grid->boxes[grid->map[i] - 1];
+    }
+    box->x = x;
+    box->y = y;
+    box->w = w;
+    box->h = h;
+    grid->dirty = 1;
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_grid_remove(lua_State *L) {
+    grid_t                  *grid = luaL_checkudata(L, 1, GRID_META);
+    int                     i = grid_find(grid, luaL_checkinteger(L, 2));
+    int                     slot, last;
+
+    if (i < 0) return 0;
+    slot = grid->map[i] - 1;
+    grid_erase(grid, i);
+
+    // move the last box into the free slot
+    last = --grid->count;
+    if (slot != last) {
+        grid->boxes[slot] = grid->boxes[last];
+        grid->map[grid_find(grid, grid->boxes[slot].id)] = slot + 1;
+    }
+    grid->dirty = 1;
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_grid_clear(lua_State *L) {
+    grid_t                  *grid = luaL_checkudata(L, 1, GRID_META);
+
+    if (grid->map != NULL) SDL_memset(grid->map, 0, sizeof(int) * grid->map_size);
+    grid->count = 0;
+    grid->dirty = 1;
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_grid_query(lua_State *L) {
+    grid_t                  *grid = luaL_checkudata(L, 1, GRID_META);
+    int                     x = check_grid_coord(L, 2, -GRID_LIMIT, GRID_LIMIT);
+    int                     y = check_grid_coord(L, 3, -GRID_LIMIT, GRID_LIMIT);
+    int                     w = check_grid_coord(L, 4, 1, GRID_LIMIT);
+    int                     h = check_grid_coord(L, 5, 1, GRID_LIMIT);
+    int                     out = check_grid_out(L, 6);
+
+    return push_grid_result(L, out, grid_query(L, grid, x, y, w, h, -1, out));
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_grid_overlaps(lua_State *L) {
+    grid_t                  *grid = luaL_checkudata(L, 1, GRID_META);
+    int                     i = grid_find(grid, luaL_checkinteger(L, 2));
+    int                     out = check_grid_out(L, 3);
+    grid_box_t              box;
+
+    if (i < 0) return push_grid_result(L, out, 0);
+    box = grid->boxes[grid->map[i] - 1];
+    return push_grid_result(L, out, grid_query(L, grid, box.x, box.y, box.w, box.h, grid->map[i] - 1, out));
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_grid_pairs(lua_State *L) {
+    grid_t                  *grid = luaL_checkudata(L, 1, GRID_META);
+    int                     out = check_grid_out(L, 2);
+    int                     i, j, k, cx, cy, n = 0;
+    const grid_box_t        *a, *b;
+
+    grid_rebuild(L, grid);
+    for (i = 0, a = grid->boxes; i < grid->count; ++i, ++a) {
+        if (grid_cells(grid, a) > GRID_BOX_CELLS) continue;
+        for (cy = floor_div(a->y, grid->cell); cy <= floor_div(a->y + a->h - 1, grid->cell); ++cy) {
+            for (cx = floor_div(a->x, grid->cell); cx <= floor_div(a->x + a->w - 1, grid->cell); ++cx) {
+                // a box may be listed twice in a bucket when two of its cells share the bucket
+                grid_next_stamp(grid);
+                k = grid_bucket(grid, cx, cy);
+                for (j = grid->buckets[k]; j < grid->buckets[k + 1]; ++j) {
+                    if (grid->items[j] <= i || grid->stamps[grid->items[j]] == grid->stamp) continue;
+                    grid->stamps[grid->items[j]] = grid->stamp;
+                    b = &grid->boxes[grid->items[j]];
+                    if (a->x >= b->x + b->w || b->x >= a->x + a->w || a->y >= b->y + b->h || b->y >= a->y + a->h) continue;
+
+                    // report a pair only in the cell of the top left corner of the intersection
+                    if (floor_div(maximum(a->x, b->x), grid->cell) != cx || floor_div(maximum(a->y, b->y), grid->cell) != cy) continue;
+                    lua_pushinteger(L, a->id);
+                    lua_rawseti(L, out, ++n);
+                    lua_pushinteger(L, b->id);
+                    lua_rawseti(L, out, ++n);
+                }
+            }
+        }
+    }
+
+    // large boxes against everything, pairs of two large boxes only once
+    for (k = 0; k < grid->large_count; ++k) {
+        i = grid->large[k];
+        a = &grid->boxes[i];
+        for (j = 0, b = grid->boxes; j < grid->count; ++j, ++b) {
+            if (j == i || (j < i && grid_cells(grid, b) > GRID_BOX_CELLS)) continue;
+            if (a->x >= b->x + b->w || b->x >= a->x + a->w || a->y >= b->y + b->h || b->y >= a->y + a->h) continue;
+            lua_pushinteger(L, minimum(i, j) == i ? a->id : b->id);
+            lua_rawseti(L, out, ++n);
+            lua_pushinteger(L, minimum(i, j) == i ? b->id : a->id);
+            lua_rawseti(L, out, ++n);
+        }
+    }
+    return push_grid_result(L, out, n);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static float particles_random(particles_t *p) {
+    // xorshift32, uniform in [0, 1)
+    p->seed ^= p->seed << 13;
+    p->seed ^= p->seed >> 17;
+    p->seed ^= p->seed << 5;
+    return (float)(p->seed >> 8) * (1.0f / 16777216.0f);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void particles_step(float * restrict x, float * restrict y, float * restrict vx, float * restrict vy,
+                           float * restrict life, float gx, float gy, int n) {
+    int                     i;
+
+    for (i = 0; i < n; ++i) {
+        vx[i] += gx;
+        vy[i] += gy;
+        x[i] += vx[i];
+        y[i] += vy[i];
+        life[i] -= 1.0f;
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void particles_update(particles_t *p) {
+    int                     i, n;
+
+    // the arrays are padded to 8 entries, updating the unused ones does no harm
+    particles_step(p->x, p->y, p->vx, p->vy, p->life, p->gx, p->gy, (p->count + 7) & ~7);
+
+    // remove dead particles by moving the last one into their place
+    for (i = 0, n = p->count; i < n; ) {
+        if (p->life[i] > 0.0f) { ++i; continue; }
+        --n;
+        p->x[i] = p->x[n]; p->y[i] = p->y[n]; p->vx[i] = p->vx[n]; p->vy[i] = p->vy[n];
+        p->life[i] = p->life[n]; p->color[i] = p->color[n];
+    }
+    p->count = n;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void draw_particles(const particles_t *p) {
+    int                     i, px, py, x0 = SDL_MAX_SINT32, y0 = SDL_MAX_SINT32, x1 = SDL_MIN_SINT32, y1 = SDL_MIN_SINT32;
+    Uint8                   *pixels;
+
+    if (target == NULL) return;
+    pixels = target->pixels;
+    for (i = 0; i < p->count; ++i) {
+        px = (int)SDL_floorf(p->x[i]);
+        py = (int)SDL_floorf(p->y[i]);
+        if ((unsigned)px >= (unsigned)target->w || (unsigned)py >= (unsigned)target->h) continue;
+        pixels[target->pitch * py + px] = p->color[i];
+        x0 = minimum(x0, px); x1 = maximum(x1, px);
+        y0 = minimum(y0, py); y1 = maximum(y1, py);
+    }
+    if (x0 <= x1) mark_dirty(x0, y0, x1, y1);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_particles(lua_State *L) {
+    int                     capacity = (int)luaL_checkinteger(L, 1);
+    Uint32                  seed = (Uint32)luaL_optinteger(L, 2, 0x2545F491);
+    particles_t             *p;
+
+    luaL_argcheck(L, capacity >= 1 && capacity <= 1000000, 1, "invalid capacity");
+    p = lua_newuserdatauv(L, sizeof(particles_t), 0);
+    SDL_zerop(p);
+    luaL_setmetatable(L, PARTICLES_META);
+
+    // all arrays in one block, floats first
+    p->stride = (capacity + 7) & ~7;
+    if ((p->x = SDL_calloc(p->stride, sizeof(float) * 5 + 1)) == NULL)
+        luaL_error(L, "out of particle memory");
+    p->y = p->x + p->stride;
+    p->vx = p->y + p->stride;
+    p->vy = p->vx + p->stride;
+    p->life = p->vy + p->stride;
+    p->color = (Uint8*)(p->life + p->stride);
+    p->capacity = capacity;
+    p->seed = seed ? seed : 1;
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_particles_gc(lua_State *L) {
+    particles_t             *p = luaL_checkudata(L, 1, PARTICLES_META);
+
+    SDL_free(p->x);
+    SDL_zerop(p);
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_particles_emit(lua_State *L) {
+    particles_t             *p = luaL_checkudata(L, 1, PARTICLES_META);
+    int                     i, count = (int)luaL_checkinteger(L, 2);
+    float                   x = (float)luaL_checknumber(L, 3);
+    float                   y = (float)luaL_checknumber(L, 4);
+    float                   speed = (float)luaL_checknumber(L, 5);
+    float                   life = (float)luaL_checknumber(L, 6);
+    Uint8                   color = (Uint8)clamp(luaL_checkinteger(L, 7), 0, 9);
+    float                   angle = (float)luaL_optnumber(L, 8, 0.0);
+    float                   spread = (float)luaL_optnumber(L, 9, 2.0 * PARTICLES_PI);
+    float                   a, v;
+
+    // particles which do not fit anymore are dropped
+    count = minimum(count, p->capacity - p->count);
+    for (i = p->count; i < p->count + count; ++i) {
+        a = angle + (particles_random(p) - 0.5f) * spread;
+        v = speed * (0.5f + 0.5f * particles_random(p));
+        p->x[i] = x;
+        p->y[i] = y;
+        p->vx[i] = SDL_cosf(a) * v;
+        p->vy[i] = SDL_sinf(a) * v;
+        p->life[i] = SDL_ceilf(life * (0.5f + 0.5f * particles_random(p)));
+        p->color[i] = color;
+    }
+    p->count += maximum(count, 0);
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_particles_gravity(lua_State *L) {
+    particles_t             *p = luaL_checkudata(L, 1, PARTICLES_META);
+
+    p->gx = (float)luaL_checknumber(L, 2);
+    p->gy = (float)luaL_checknumber(L, 3);
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_particles_update(lua_State *L) {
+    particles_update(luaL_checkudata(L, 1, PARTICLES_META));
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_particles_draw(lua_State *L) {
+    draw_particles(luaL_checkudata(L, 1, PARTICLES_META));
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_particles_clear(lua_State *L) {
+    ((particles_t*)luaL_checkudata(L, 1, PARTICLES_META))->count = 0;
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_particles_count(lua_State *L) {
+    lua_pushinteger(L, ((particles_t*)luaL_checkudata(L, 1, PARTICLES_META))->count);
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_stats(lua_State *L) {
+    lua_createtable(L, 0, 11);
+    lua_pushinteger(L, present_bytes); lua_setfield(L, -2, "present_bytes");
+    lua_pushinteger(L, present_tiles); lua_setfield(L, -2, "dirty_tiles");
+    lua_pushnumber(L, present_time); lua_setfield(L, -2, "present_time");
+    lua_pushnumber(L, frame_time); lua_setfield(L, -2, "frame_time");
+    lua_pushnumber(L, frame_jitter); lua_setfield(L, -2, "jitter");
+    lua_pushnumber(L, frame_jitter_max); lua_setfield(L, -2, "jitter_max");
+    lua_pushinteger(L, skipped_draws); lua_setfield(L, -2, "skipped_draws");
+    lua_pushnumber(L, (double)dropped_ticks * 1000.0 / FPS); lua_setfield(L, -2, "dropped_time");
+    lua_pushnumber(L, SDL_AtomicGet(&audio_latency) / 1000.0); lua_setfield(L, -2, "audio_latency");
+    lua_pushnumber(L, SDL_AtomicGet(&audio_latency_max) / 1000.0); lua_setfield(L, -2, "audio_latency_max");
+    lua_pushinteger(L, audio_dropped); lua_setfield(L, -2, "audio_dropped");
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_catchup(lua_State *L) {
+    if (lua_gettop(L) > 0) {
+        lua_Integer         ticks = luaL_checkinteger(L, 1);
+        max_catchup = (int)clamp(ticks, 1, FPS);
+    }
+    lua_pushinteger(L, max_catchup);
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void free_retired_songs() {
+    Uint32                  tail = (Uint32)SDL_AtomicGet(&audio_retired_tail);
+    Uint32                  head = (Uint32)SDL_AtomicGet(&audio_retired_head);
+
+    for (; tail != head; ++tail) SDL_free(audio_retired[tail % AUDIO_COMMANDS]);
+    SDL_AtomicSet(&audio_retired_tail, (int)tail);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int send_audio_command(int type, int voice, mml_song_t *song, float gain) {
+    Uint32                  head = (Uint32)SDL_AtomicGet(&audio_command_head);
+    audio_command_t         *command = &audio_commands[head % AUDIO_COMMANDS];
+
+    // the audio callback runs the commands at the start of its next buffer
+    free_retired_songs();
+    if (head - (Uint32)SDL_AtomicGet(&audio_command_tail) >= AUDIO_COMMANDS) {
+        // a stalled audio device (or a suspended AudioContext) must not stop the game
+        SDL_free(song);
+        ++audio_dropped;
+        return 0;
+    }
+    command->type = type;
+    command->voice = voice;
+    command->song = song;
+    command->gain = gain;
+    command->sent = SDL_GetPerformanceCounter();
+    SDL_AtomicSet(&audio_command_head, (int)(head + 1));
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_gain(lua_State *L) {
+    if (lua_gettop(L) > 0) {
+        lua_Number          gain = luaL_checknumber(L, 1);
+
+        gain = clamp(gain, 0.0, 1.0);
+        if (send_audio_command(AUDIO_GAIN, 0, NULL, (float)gain)) audio_gain = (float)gain;
+    }
+
+    lua_pushnumber(L, audio_gain);
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static Uint64 song_duration(const mml_song_t *song) {
+    Uint64                  length = 0;
+    int                     i;
+
+    // looping songs never end, others after all notes and the silent sample before each
+    if (song->loop >= 0) return ~(Uint64)0;
+    for (i = 0; i < song->count; ++i) length += (Uint64)song->events[i].ttl + 1;
+    return (Uint64)(length * SDL_GetPerformanceFrequency() / audio_frequency);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void claim_voice(int i, int priority, Uint64 duration) {
+    voice_slot_t            *slot = &voice_slots[i];
+
+    slot->gen = (slot->gen + 1) & 0xffffff;
+    if (slot->gen == 0) slot->gen = 1;
+    slot->priority = priority;
+    slot->started = SDL_GetPerformanceCounter();
+    slot->ends = duration == ~(Uint64)0 ? duration : slot->started + duration;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int allocate_voice(int priority) {
+    Uint64                  now = SDL_GetPerformanceCounter();
+    int                     i, best = -1;
+    voice_slot_t            *slot, *other;
+
+    for (i = voice_music; i < voice_count; ++i) {
+        slot = &voice_slots[i];
+        if (now >= slot->ends) return i; // a free voice
+        if (slot->priority > priority) continue;
+        if (best < 0) { best = i; continue; }
+        // steal the lowest priority, then the oldest or quietest voice
+        other = &voice_slots[best];
+        if (slot->priority != other->priority) {
+            if (slot->priority < other->priority) best = i;
+        } else if (voice_policy == VOICE_OLDEST) {
+            if (slot->started < other->started) best = i;
+        } else if (SDL_AtomicGet(&audio_levels[i]) < SDL_AtomicGet(&audio_levels[best])) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_voices(lua_State *L) {
+    static const char       *policies[] = { "oldest", "quietest", NULL };
+    int                     i;
+
+    if (lua_gettop(L) > 0) {
+        int                 total = (int)luaL_checkinteger(L, 1);
+        int                 music = (int)luaL_optinteger(L, 2, minimum(AUDIO_MUSIC_VOICES, total - 1));
+
+        luaL_argcheck(L, total >= 1 && total <= AUDIO_VOICES, 1, "invalid number of voices");
+        luaL_argcheck(L, music >= 0 && music <= total, 2, "invalid number of music voices");
+        voice_policy = luaL_checkoption(L, 3, policies[voice_policy], policies);
+        // voices beyond the new total are silenced
+        for (i = total; i < voice_count; ++i) {
+            if (send_audio_command(AUDIO_STOP, i, NULL, 0.0f)) voice_slots[i].ends = 0;
+        }
+        voice_count = total;
+        voice_music = music;
+    }
+
+    lua_pushinteger(L, voice_count);
+    lua_pushinteger(L, voice_music);
+    lua_pushstring(L, policies[voice_policy]);
+    return 3;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_play(lua_State *L) {
+    size_t                  length;
+    mml_song_t              *song;
+    Uint64                  duration;
+    int                     i, priority;
+
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        // sound effect on a voice of the pool
+        const char          *mml = luaL_checklstring(L, 1, &length);
+        priority = (int)luaL_optinteger(L, 2, 0);
+        luaL_argcheck(L, length > 0, 1, "invalid length of MML string");
+        if (voice_music >= voice_count) luaL_error(L, "no sound effect voices, see ltro.voices()");
+        song = mml_compile(L, mml);
+        if ((i = allocate_voice(priority)) < 0) {
+            SDL_free(song);
+            lua_pushnil(L);
+            return 1;
+        }
+    } else {
+        // explicit channel, never stolen by the pool
+        const char          *mml = luaL_checklstring(L, 2, &length);
+        i = (int)(check_voice(L, 1) - audio_voices);
+        priority = SDL_MAX_SINT32;
+        luaL_argcheck(L, length > 0, 2, "invalid length of MML string");
+        song = mml_compile(L, mml);
+    }
+
+    // the song belongs to the audio thread once it is sent
+    duration = song_duration(song);
+    if (!send_audio_command(AUDIO_PLAY, i, song, 0.0f)) {
+        lua_pushnil(L);
+        return 1;
+    }
+    claim_voice(i, priority, duration);
+    // the low 5 bits are the channel number, like the explicit channels
+    lua_pushinteger(L, ((lua_Integer)voice_slots[i].gen << 5) | (i + 1));
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int f_stop(lua_State *L) {
+    lua_Integer             n = luaL_checkinteger(L, 1);
+    int                     i;
+
+    if (n >= 32) {
+        // a handle only stops the voice while it still plays that sound
+        i = (int)(n & 31) - 1;
+        if (i < 0 || i >= voice_count || voice_slots[i].gen != (int)(n >> 5)) return 0;
+    } else {
+        i = (int)(check_voice(L, 1) - audio_voices);
+    }
+    if (send_audio_command(AUDIO_STOP, i, NULL, 0.0f)) voice_slots[i].ends = 0;
+    return 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static const luaL_Reg       funcs[] = {
+    { "quit",               f_quit          },
+    { "btn",                f_btn           },
+    { "btnp",               f_btnp          },
+    { "clearcolor",         f_clearcolor    },
+    { "clear",              f_clear         },
+    { "scroll",             f_scroll        },
     { "pixel",              f_pixel         },
     { "line",               f_line          },
+    { "lines",              f_lines         },
     { "rect",               f_rect          },
     { "circle",             f_circle        },
+    { "batch",              f_batch         },
     { "print",              f_print         },
     { "draw",               f_draw          },
+    { "sprite",             f_sprite        },
+    { "sheet",              f_sheet         },
+    { "spr",                f_spr           },
+    { "overlap",            f_overlap       },
+    { "grid",               f_grid          },
+    { "particles",          f_particles     },
+    { "canvas",             f_canvas        },
+    { "target",             f_target        },
+    { "layers",             f_layers        },
+    { "layer",              f_layer         },
+    { "map",                f_map           },
+    { "stats",              f_stats         },
+    { "catchup",            f_catchup       },
     { "gain",               f_gain          },
     { "play",               f_play          },
     { "stop",               f_stop          },
+    { "voices",             f_voices        },
+    { NULL,                 NULL            }
+};
+
+
+/*----------------------------------------------------------------------------*/
+static const luaL_Reg       sprite_funcs[] = {
+    { "__gc",               f_sprite_gc     },
+    { NULL,                 NULL            }
+};
+
+
+/*----------------------------------------------------------------------------*/
+static const luaL_Reg       sheet_funcs[] = {
+    { "__gc",               f_sheet_gc      },
+    { "__len",              f_sheet_len     },
     { NULL,                 NULL            }
 };
 
 
+/*----------------------------------------------------------------------------*/
+static const luaL_Reg       canvas_funcs[] = {
+    { "size",               f_canvas_size   },
+    { NULL,                 NULL            }
+};
+
+
+/*----------------------------------------------------------------------------*/
+static const luaL_Reg       map_funcs[] = {
+    { "tiles",              f_map_tiles     },
+    { "size",               f_map_size      },
+    { "get",                f_map_get       },
+    { "set",                f_map_set       },
+    { "load",               f_map_load      },
+    { "dump",               f_map_dump      },
+    { NULL,                 NULL            }
+};
+
+
+/*----------------------------------------------------------------------------*/
+static const luaL_Reg       grid_funcs[] = {
+    { "set",                f_grid_set      },
+    { "remove",             f_grid_remove   },
+    { "clear",              f_grid_clear    },
+    { "query",              f_grid_query    },
+    { "overlaps",           f_grid_overlaps },
+    { "pairs",              f_grid_pairs    },
+    { NULL,                 NULL            }
+};
+
+
+/*----------------------------------------------------------------------------*/
+static const luaL_Reg       particles_funcs[] = {
+    { "emit",               f_particles_emit    },
+    { "gravity",            f_particles_gravity },
+    { "update",             f_particles_update  },
+    { "draw",               f_particles_draw    },
+    { "clear",              f_particles_clear   },
+    { "count",              f_particles_count   },
+    { NULL,                 NULL                }
+};
+
+
 /*----------------------------------------------------------------------------*/
 static int luaopen_ltro1(lua_State *L) {
+    luaL_newmetatable(L, SPRITE_META);
+    luaL_setfuncs(L, sprite_funcs, 0);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, SHEET_META);
+    luaL_setfuncs(L, sheet_funcs, 0);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, CANVAS_META);
+    lua_pushcfunction(L, f_canvas_gc);
+    lua_setfield(L, -2, "__gc");
+    luaL_newlib(L, canvas_funcs);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, GRID_META);
+    lua_pushcfunction(L, f_grid_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, f_grid_len);
+    lua_setfield(L, -2, "__len");
+    luaL_newlib(L, grid_funcs);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, PARTICLES_META);
+    lua_pushcfunction(L, f_particles_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, f_particles_count);
+    lua_setfield(L, -2, "__len");
+    luaL_newlib(L, particles_funcs);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, MAP_META);
+    luaL_newlib(L, map_funcs);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
     luaL_newlib(L, funcs);
     lua_pushstring(L, LTRO_VERSION); lua_setfield(L, -2, "_VERSION");
     lua_pushstring(L, LTRO_AUTHOR); lua_setfield(L, -2, "_AUTHOR");
@@ -857,8 +3477,12 @@ static void run_sprite_editor_tick() {
     static Uint8            pixels[12][12];
     static int              current_color = 0;
     int                     i, x, y, x0, y0, x1, y1;
+    SDL_Surface             *previous = target;
+    layer_t                 *previous_layer = target_layer;
 
-    SDL_FillRect(surface8, NULL, 0);
+    target = surface8;
+    target_layer = &layers[0];
+    draw_rect(0, 0, SCREEN_WIDTH - 1, SCREEN_HEIGHT - 1, 0, 1);
 
     // show color palette
     for (i = 0; i < 10; ++i) {
@@ -912,6 +3536,234 @@ static void run_sprite_editor_tick() {
     if (handle_button(224, 8, "1212000000000000002222222000222222222220022222222200020202020200020202020200020202020200020202020200020202020200020202020200022222222200000000000000")) {
         for (y = 0; y < 12; ++y) for (x = 0; x < 12; ++x) pixels[x][y] = 0;
     }
+    target = previous;
+    target_layer = previous_layer;
+}
+
+
+/*
+================================================================================
+
+        INPUT RECORDING
+
+================================================================================
+*/
+/*----------------------------------------------------------------------------*/
+static void *grow_replay(lua_State *L, void *array, int *capacity, int count, size_t size) {
+    if (count < *capacity) return array;
+    *capacity = *capacity ? *capacity * 2 : 256;
+    if ((array = SDL_realloc(array, size * *capacity)) == NULL)
+        luaL_error(L, "out of replay memory");
+    return array;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void put_le(Uint8 *p, Uint64 value, int n) {
+    for (; n > 0; --n, value >>= 8) *p++ = (Uint8)value;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static Uint64 get_le(const Uint8 *p, int n) {
+    Uint64                  value = 0;
+    for (p += n; n > 0; --n) value = (value << 8) | *--p;
+    return value;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static Uint32 hash_int(Uint32 hash, int value) {
+    int                     i;
+
+    for (i = 0; i < 32; i += 8) hash = (hash ^ (((Uint32)value >> i) & 0xff)) * 16777619u;
+    return hash;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static Uint32 hash_layers() {
+    Uint32                  hash = 2166136261u;
+    const Uint8             *row;
+    int                     i, x, y;
+
+    // FNV-1a over the layer setup and the pixels of all layers, the offsets and masks change the screen too
+    hash = hash_int(hash, layer_count);
+    for (i = 0; i < layer_count; ++i) {
+        hash = hash_int(hash, layers[i].ox);
+        hash = hash_int(hash, layers[i].oy);
+        hash = hash_int(hash, layers[i].key);
+        for (y = 0; y < layers[i].surface->h; ++y) {
+            row = (const Uint8*)layers[i].surface->pixels + layers[i].surface->pitch * y;
+            for (x = 0; x < layers[i].surface->w; ++x) hash = (hash ^ row[x]) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void load_replay(lua_State *L) {
+    Uint8                   *data;
+    size_t                  size;
+    int                     i;
+
+    if ((data = SDL_LoadFile(replay_path, &size)) == NULL)
+        luaL_error(L, "cannot load replay '%s': %s", replay_path, SDL_GetError());
+    if (size < REPLAY_HEADER || SDL_memcmp(data, REPLAY_MAGIC, 4)) {
+        SDL_free(data);
+        luaL_error(L, "'%s' is not a replay file", replay_path);
+    }
+    replay_seed = (lua_Integer)get_le(data + 4, 8);
+    replay_run_count = (int)get_le(data + 12, 4);
+    replay_hash_count = (int)get_le(data + 16, 4);
+    if (replay_run_count < 0 || replay_hash_count < 0 ||
+        size != REPLAY_HEADER + (Uint64)replay_run_count * REPLAY_RUN + (Uint64)replay_hash_count * REPLAY_HASH) {
+        SDL_free(data);
+        luaL_error(L, "replay '%s' is truncated", replay_path);
+    }
+
+    replay_runs = SDL_malloc(sizeof(replay_run_t) * (replay_run_count + 1));
+    replay_hashes = SDL_malloc(sizeof(replay_hash_t) * (replay_hash_count + 1));
+    if (replay_runs == NULL || replay_hashes == NULL) {
+        SDL_free(data);
+        luaL_error(L, "out of replay memory");
+    }
+    for (i = 0; i < replay_run_count; ++i) {
+        const Uint8         *p = data + REPLAY_HEADER + i * REPLAY_RUN;
+        replay_runs[i].ticks = (Uint32)get_le(p, 4);
+        replay_runs[i].down = p[4];
+        replay_runs[i].pressed = p[5];
+    }
+    for (i = 0; i < replay_hash_count; ++i) {
+        const Uint8         *p = data + REPLAY_HEADER + replay_run_count * REPLAY_RUN + i * REPLAY_HASH;
+        replay_hashes[i].tick = (Uint32)get_le(p, 4);
+        replay_hashes[i].hash = (Uint32)get_le(p + 4, 4);
+    }
+    SDL_free(data);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void save_replay() {
+    Uint8                   *data, *p;
+    size_t                  size = REPLAY_HEADER + replay_run_count * REPLAY_RUN + replay_hash_count * REPLAY_HASH;
+    SDL_RWops               *rw;
+    int                     i;
+
+    if ((data = SDL_malloc(size)) == NULL) {
+        SDL_Log("cannot save replay '%s': out of memory", replay_path);
+        return;
+    }
+    SDL_memcpy(data, REPLAY_MAGIC, 4);
+    put_le(data + 4, (Uint64)replay_seed, 8);
+    put_le(data + 12, (Uint64)replay_run_count, 4);
+    put_le(data + 16, (Uint64)replay_hash_count, 4);
+    for (i = 0, p = data + REPLAY_HEADER; i < replay_run_count; ++i, p += REPLAY_RUN) {
+        put_le(p, replay_runs[i].ticks, 4);
+        p[4] = replay_runs[i].down;
+        p[5] = replay_runs[i].pressed;
+    }
+    for (i = 0; i < replay_hash_count; ++i, p += REPLAY_HASH) {
+        put_le(p, replay_hashes[i].tick, 4);
+        put_le(p + 4, replay_hashes[i].hash, 4);
+    }
+
+    if ((rw = SDL_RWFromFile(replay_path, "wb")) == NULL || SDL_RWwrite(rw, data, size, 1) != 1)
+        SDL_Log("cannot save replay '%s': %s", replay_path, SDL_GetError());
+    else
+        SDL_Log("recorded %u ticks to '%s'", (unsigned)replay_tick, replay_path);
+    if (rw != NULL) SDL_RWclose(rw);
+    SDL_free(data);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void start_replay(lua_State *L) {
+    if (replay_mode == REPLAY_OFF) return;
+    if (replay_mode == REPLAY_PLAY) load_replay(L);
+    else replay_seed = (lua_Integer)SDL_GetPerformanceCounter();
+
+    // the recorded seed makes math.random() repeat itself
+    lua_getglobal(L, "math");
+    lua_getfield(L, -1, "randomseed");
+    lua_remove(L, -2);
+    lua_pushinteger(L, replay_seed);
+    lua_call(L, 1, 0);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void finish_replay() {
+    if (replay_mode == REPLAY_RECORD)
+        save_replay();
+    else if (replay_mode == REPLAY_PLAY && replay_verify && !replay_failed)
+        SDL_Log("replayed %u ticks, %d frame hashes matched", (unsigned)replay_tick, replay_checked);
+    SDL_free(replay_runs);
+    SDL_free(replay_hashes);
+    replay_runs = NULL;
+    replay_hashes = NULL;
+    replay_mode = REPLAY_OFF;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int replay_input(lua_State *L) {
+    replay_run_t            *run;
+
+    switch (replay_mode) {
+        case REPLAY_RECORD:
+            // consecutive ticks with the same input share one run
+            run = replay_run_count ? &replay_runs[replay_run_count - 1] : NULL;
+            if (run && run->down == btn_down && run->pressed == btn_pressed && run->ticks < 0xffffffffu) {
+                ++run->ticks;
+            } else {
+                replay_runs = grow_replay(L, replay_runs, &replay_run_capacity, replay_run_count, sizeof(replay_run_t));
+                run = &replay_runs[replay_run_count++];
+                run->ticks = 1;
+                run->down = btn_down;
+                run->pressed = btn_pressed;
+            }
+            break;
+
+        case REPLAY_PLAY:
+            while (replay_run_index < replay_run_count && replay_used >= replay_runs[replay_run_index].ticks) {
+                ++replay_run_index;
+                replay_used = 0;
+            }
+            if (replay_run_index >= replay_run_count) return 0; // end of the recording
+            btn_down = replay_runs[replay_run_index].down;
+            btn_pressed = replay_runs[replay_run_index].pressed;
+            ++replay_used;
+            break;
+    }
+    ++replay_tick;
+    return 1;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void replay_frame(lua_State *L) {
+    Uint32                  hash;
+
+    if (replay_mode == REPLAY_OFF || ltro_mode != LTRO_LUA || replay_tick == 0) return;
+    if (replay_mode == REPLAY_RECORD) {
+        replay_hashes = grow_replay(L, replay_hashes, &replay_hash_capacity, replay_hash_count, sizeof(replay_hash_t));
+        replay_hashes[replay_hash_count].tick = replay_tick;
+        replay_hashes[replay_hash_count++].hash = hash_layers();
+    } else if (replay_verify) {
+        // only frames that were presented while recording can be compared
+        while (replay_hash_index < replay_hash_count && replay_hashes[replay_hash_index].tick < replay_tick)
+            ++replay_hash_index;
+        if (replay_hash_index >= replay_hash_count || replay_hashes[replay_hash_index].tick != replay_tick) return;
+        if ((hash = hash_layers()) != replay_hashes[replay_hash_index].hash) {
+            SDL_Log("replay diverged at tick %u (frame hash %08x, recorded %08x)",
+                    (unsigned)replay_tick, (unsigned)hash, (unsigned)replay_hashes[replay_hash_index].hash);
+            replay_failed = 1;
+            ltro_mode = LTRO_QUIT;
+        }
+        ++replay_checked;
+    }
 }
 
 
@@ -944,8 +3796,8 @@ static void handle_SDL_key(const SDL_Keycode code, const int down) {
     if (down) {
         switch (code) {
             case SDLK_ESCAPE: ltro_mode = LTRO_QUIT; return;
-            case SDLK_F1: ltro_mode = LTRO_LUA; return;
-            case SDLK_F2: ltro_mode = LTRO_SPRITE_EDITOR; return;
+            case SDLK_F1: ltro_mode = LTRO_LUA; mark_all_dirty(); return;
+            case SDLK_F2: ltro_mode = LTRO_SPRITE_EDITOR; mark_all_dirty(); return;
         }
     }
 
@@ -1022,43 +3874,140 @@ static void handle_SDL_events() {
             case SDL_MOUSEBUTTONUP:
                 handle_mouse_button(ev.button.button, 0);
                 break;
+
+            case SDL_RENDER_TARGETS_RESET:
+            case SDL_RENDER_DEVICE_RESET:
+                mark_all_dirty();
+                break;
         }
     }
 }
 
 
 /*----------------------------------------------------------------------------*/
-static void run_lua_tick(lua_State *L) {
-        if (push_callback(L, "on_tick")) {
-            lua_pushinteger(L, frame_counter);
-            lua_call(L, 1, 0);
+static void run_lua_tick(lua_State *L, const char *name, lua_Integer counter) {
+    if (push_callback(L, name)) {
+        lua_pushinteger(L, counter);
+        lua_call(L, 1, 0);
+    }
+}
+
+
+/*----------------------------------------------------------------------------*/
+static Uint64 tick_deadline(Uint64 tick) {
+    // counter value at which the given tick is due, without accumulating rounding errors
+    return tick_base + (tick + 1) * SDL_GetPerformanceFrequency() / FPS;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void reset_tick_clock() {
+    tick_base = SDL_GetPerformanceCounter();
+    tick_count = 0;
+    last_present = 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void measure_frame_time() {
+    Uint64                  now = SDL_GetPerformanceCounter();
+    double                  deviation;
+
+    if (last_present != 0) {
+        frame_time = (double)(now - last_present) * 1000.0 / (double)SDL_GetPerformanceFrequency();
+        deviation = SDL_fabs(frame_time - 1000.0 / FPS);
+        jitter_sum += deviation;
+        jitter_max = maximum(jitter_max, deviation);
+        if (++jitter_frames >= FPS_JITTER_WINDOW) {
+            frame_jitter = jitter_sum / jitter_frames;
+            frame_jitter_max = jitter_max;
+            jitter_sum = jitter_max = 0.0;
+            jitter_frames = 0;
         }
+    }
+    last_present = now;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void drop_late_ticks() {
+    Uint64                  now = SDL_GetPerformanceCounter();
+
+    for (; now >= tick_deadline(tick_count); ++tick_count) ++dropped_ticks;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int split_callbacks(lua_State *L) {
+    // on_update replaces on_tick, on_draw alone never stops on_tick
+    return (ltro_mode == LTRO_LUA) && has_callback(L, "on_update");
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void run_tick(lua_State *L, int split) {
+    switch (ltro_mode) {
+        case LTRO_LUA:
+            if (replay_input(L)) run_lua_tick(L, split ? "on_update" : "on_tick", frame_counter);
+            else ltro_mode = LTRO_QUIT;
+            break;
+        case LTRO_SPRITE_EDITOR: run_sprite_editor_tick(); break;
+    }
+    ++frame_counter;
+    btn_pressed = 0;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void present_frame(lua_State *L, int split, int ticks) {
+    if (ltro_mode == LTRO_LUA) {
+        run_lua_tick(L, "on_draw", frame_counter - 1);
+        if (split) skipped_draws += ticks - 1;
+    }
+    replay_frame(L);
+    measure_frame_time();
+    render_screen(L);
 }
 
 
 /*----------------------------------------------------------------------------*/
 static void run_event_cycle(lua_State *L) {
-    Uint32                  current_tick;
+    int                     ticks = 0;
+    int                     split = split_callbacks(L);
 
     handle_SDL_events();
 
-    current_tick = SDL_GetTicks();
-    delta_ticks += current_tick - last_tick;
-    last_tick = current_tick;
-
-    for (; delta_ticks >= FPS_TICKS; delta_ticks -= FPS_TICKS) {
-        switch (ltro_mode) {
-            case LTRO_LUA: run_lua_tick(L); break;
-            case LTRO_SPRITE_EDITOR: run_sprite_editor_tick(); break;
+    for (; SDL_GetPerformanceCounter() >= tick_deadline(tick_count); ++tick_count) {
+        // only separate update / draw callbacks get a bounded catch-up
+        if (split && ticks >= max_catchup) {
+            drop_late_ticks();
+            break;
         }
-        ++frame_counter;
-        btn_pressed = 0;
+        run_tick(L, split);
+        ++ticks;
     }
 
-    render_screen(L);
+    // nothing new to show, so do not present a duplicate frame
+    if (ticks) present_frame(L, split, ticks);
 }
 
 
+/*----------------------------------------------------------------------------*/
+#ifndef __EMSCRIPTEN__
+static void wait_for_next_tick() {
+    Uint64                  deadline = tick_deadline(tick_count);
+    Uint64                  frequency = SDL_GetPerformanceFrequency();
+    Uint64                  now;
+
+    // sleep whole milliseconds, only spin for the sub-millisecond rest
+    while ((now = SDL_GetPerformanceCounter()) < deadline) {
+        Uint32              ms = (Uint32)((deadline - now) * 1000 / frequency);
+        if (ms > 0) SDL_Delay(ms);
+    }
+}
+#endif /* __EMSCRIPTEN__ */
+
+
 /*----------------------------------------------------------------------------*/
 #ifdef __EMSCRIPTEN__
 static lua_State            *global_L;
@@ -1083,6 +4032,7 @@ static void fetch_on_success(emscripten_fetch_t *fetch) {
     int                     status;
     
     // compile the downloaded Lua script
+    start_replay(global_L);
     status = luaL_loadbuffer(global_L, (const char*)fetch->data, (size_t)fetch->numBytes, "@game.lua");
     emscripten_fetch_close(fetch);
     if (status != LUA_OK) lua_error(global_L);
@@ -1093,6 +4043,7 @@ static void fetch_on_success(emscripten_fetch_t *fetch) {
         lua_call(global_L, 0, 0);
     
     // make sure the event loop will continue
+    reset_tick_clock();
     file_fetched = -1;
 }
 
@@ -1117,16 +4068,66 @@ static void run_event_loop(lua_State *L) {
     attr.onerror = fetch_on_error;
     emscripten_fetch(&attr, "game.lua");
 
-    last_tick = SDL_GetTicks();
+    reset_tick_clock();
     emscripten_set_main_loop(run_event_step, 0, 1);    
 
     if (push_callback(global_L, "on_quit"))
         lua_call(global_L, 0, 0);
 }
 #else
+/*----------------------------------------------------------------------------*/
+static int compare_tick_times(const void *a, const void *b) {
+    Uint64                  x = *(const Uint64*)a, y = *(const Uint64*)b;
+    return (x > y) - (x < y);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void run_headless_loop(lua_State *L) {
+    static float            audio[AUDIO_FREQUENCY / FPS];
+    double                  frequency = (double)SDL_GetPerformanceFrequency();
+    Uint64                  begin, start, *times = NULL;
+    int                     n, split, capacity = 0;
+    double                  total;
+
+    // as fast as possible, without waiting for the next tick
+    begin = SDL_GetPerformanceCounter();
+    for (n = 0; ltro_mode && (headless_frames <= 0 || n < headless_frames); ++n) {
+        start = SDL_GetPerformanceCounter();
+        handle_SDL_events();
+        split = split_callbacks(L);
+        run_tick(L, split);
+        if (!ltro_mode) break;
+        present_frame(L, split, 1);
+
+        // the audio output is thrown away, but the voices keep playing
+        mix_audio_voices(NULL, (Uint8*)audio, sizeof(audio));
+
+        if (n >= capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            if ((times = SDL_realloc(times, sizeof(Uint64) * capacity)) == NULL)
+                luaL_error(L, "out of memory");
+        }
+        times[n] = SDL_GetPerformanceCounter() - start;
+    }
+    total = (double)(SDL_GetPerformanceCounter() - begin) / frequency;
+
+    // report throughput and tick time percentiles
+    if (n > 0) {
+        SDL_qsort(times, n, sizeof(Uint64), compare_tick_times);
+        SDL_Log("%d ticks in %.3f s, %.1f ticks/s", n, total, total > 0.0 ? n / total : 0.0);
+        SDL_Log("tick time p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms",
+                times[(n - 1) * 50 / 100] * 1000.0 / frequency, times[(n - 1) * 90 / 100] * 1000.0 / frequency,
+                times[(n - 1) * 99 / 100] * 1000.0 / frequency, times[n - 1] * 1000.0 / frequency);
+    }
+    SDL_free(times);
+}
+
+
 /*----------------------------------------------------------------------------*/
 static void run_event_loop(lua_State *L) {
     // load script and execute
+    start_replay(L);
     if (luaL_loadfile(L, "game.lua") != LUA_OK)
         lua_error(L);
     lua_call(L, 0, 0);
@@ -1136,8 +4137,15 @@ static void run_event_loop(lua_State *L) {
         lua_call(L, 0, 0);
 
     // run the whole event loop
-    last_tick = SDL_GetTicks();
-    while (ltro_mode) run_event_cycle(L);
+    reset_tick_clock();
+    if (headless) {
+        run_headless_loop(L);
+    } else {
+        while (ltro_mode) {
+            run_event_cycle(L);
+            if (ltro_mode) wait_for_next_tick();
+        }
+    }
 
     // call on_quit
     if (push_callback(L, "on_quit"))
@@ -1154,21 +4162,10 @@ static void run_event_loop(lua_State *L) {
 ================================================================================
 */
 /*----------------------------------------------------------------------------*/
-static int initialize_ltro1(lua_State *L) {
-    int                     w, h, bpp;
-    Uint32                  pixel_format, rmask, gmask, bmask, amask;
+static Uint32 open_window(lua_State *L) {
+    int                     w, h;
+    Uint32                  pixel_format;
     SDL_DisplayMode         dm;
-    SDL_AudioSpec           want, have;
-
-    SDL_zero(audio_voices);
-
-    #ifdef __EMSCRIPTEN__
-        if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_EVENTS | SDL_INIT_TIMER | SDL_INIT_GAMECONTROLLER))
-            luaL_error(L, "SDL_Init() failed: %s", SDL_GetError());
-    #else
-        if (SDL_Init(SDL_INIT_EVERYTHING))
-            luaL_error(L, "SDL_Init() failed: %s", SDL_GetError());
-    #endif /* __EMSCRIPTEN__ */
 
     // determine best window size
     w = SCREEN_WIDTH; h = SCREEN_HEIGHT;
@@ -1183,22 +4180,22 @@ static int initialize_ltro1(lua_State *L) {
         luaL_error(L, "SDL_CreateWindow() failed: %s", SDL_GetError());
     if ((pixel_format = SDL_GetWindowPixelFormat(window)) == SDL_PIXELFORMAT_UNKNOWN)
         luaL_error(L, "SDL_GetWindowPixelFormat() failed: %s", SDL_GetError());
-    if (SDL_PixelFormatEnumToMasks(pixel_format, &bpp, &rmask, &gmask, &bmask, &amask) == SDL_FALSE)
-        luaL_error(L, "SDL_PixelFormatEnumToMasks() failed: %s", SDL_GetError());
+    if (SDL_BYTESPERPIXEL(pixel_format) != 4)
+        pixel_format = SDL_PIXELFORMAT_ARGB8888;
     if ((renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC)) == NULL)
         luaL_error(L, "SDL_CreateRenderer() failed: %s", SDL_GetError());
     if (SDL_RenderSetLogicalSize(renderer, SCREEN_WIDTH, SCREEN_HEIGHT))
         luaL_error(L, "SDL_RenderSetLogicalSize() failed: %s", SDL_GetError());
     if ((texture = SDL_CreateTexture(renderer, pixel_format, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT)) == NULL)
         luaL_error(L, "SDL_CreateTexture() failed: %s", SDL_GetError());
-    if ((surface32 = SDL_CreateRGBSurface(0, SCREEN_WIDTH, SCREEN_HEIGHT, bpp, rmask, gmask, bmask, amask)) == NULL)
-        luaL_error(L, "SDL_CreateRGBSurface() failed: %s", SDL_GetError());
-    if ((surface8 = SDL_CreateRGBSurface(0, SCREEN_WIDTH, SCREEN_HEIGHT, 8, 0, 0, 0, 0)) == NULL)
-        luaL_error(L, "SDL_CreateRGBSurface() failed: %s", SDL_GetError());
-    if (SDL_SetPaletteColors(surface8->format->palette, palette, 0, 10))
-        luaL_error(L, "SDL_SetPaletteColors() failed: %s", SDL_GetError());
+    return pixel_format;
+}
+
+
+/*----------------------------------------------------------------------------*/
+static void open_audio(lua_State *L) {
+    SDL_AudioSpec           want, have;
 
-    // initialize audio
     SDL_zero(want); SDL_zero(have);
     want.freq = AUDIO_FREQUENCY;
     want.channels = 1;
@@ -1210,7 +4207,49 @@ static int initialize_ltro1(lua_State *L) {
     if ((have.format != AUDIO_F32SYS) || (have.channels != 1))
         luaL_error(L, "SDL_OpenAudioDevice() returned with wrong configuration");
     audio_frequency = have.freq;
+    init_audio_steps();
     SDL_PauseAudioDevice(audio_device, SDL_FALSE);
+}
+
+
+/*----------------------------------------------------------------------------*/
+static int initialize_ltro1(lua_State *L) {
+    Uint32                  pixel_format;
+
+    SDL_zero(audio_voices);
+    init_glyphs();
+
+    #ifdef __EMSCRIPTEN__
+        if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_EVENTS | SDL_INIT_TIMER | SDL_INIT_GAMECONTROLLER))
+            luaL_error(L, "SDL_Init() failed: %s", SDL_GetError());
+    #else
+        if (SDL_Init(headless ? SDL_INIT_EVENTS | SDL_INIT_TIMER : SDL_INIT_EVERYTHING))
+            luaL_error(L, "SDL_Init() failed: %s", SDL_GetError());
+    #endif /* __EMSCRIPTEN__ */
+
+    // headless runs present into memory, without window, renderer or audio device
+    if (headless) {
+        if ((present_memory = SDL_calloc(SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(Uint32))) == NULL)
+            luaL_error(L, "out of memory");
+        pixel_format = SDL_PIXELFORMAT_ARGB8888;
+        audio_frequency = AUDIO_FREQUENCY;
+        init_audio_steps();
+    } else {
+        pixel_format = open_window(L);
+    }
+
+    if ((surface8 = SDL_CreateRGBSurface(0, SCREEN_WIDTH, SCREEN_HEIGHT, 8, 0, 0, 0, 0)) == NULL)
+        luaL_error(L, "SDL_CreateRGBSurface() failed: %s", SDL_GetError());
+    if (SDL_SetPaletteColors(surface8->format->palette, palette, 0, 10))
+        luaL_error(L, "SDL_SetPaletteColors() failed: %s", SDL_GetError());
+    layers[0].surface = surface8;
+    layers[0].key = -1;
+    select_layer(0);
+    init_present(L, pixel_format);
+    mark_all_dirty();
+
+    // initialize audio
+    if (!headless) open_audio(L);
 
     // run event loop
     run_event_loop(L);
@@ -1220,18 +4259,35 @@ static int initialize_ltro1(lua_State *L) {
 
 /*----------------------------------------------------------------------------*/
 static void shutdown_ltro1() {
+    int                     i;
+
     if (audio_device != 0)
         SDL_CloseAudioDevice(audio_device);
+    free_retired_songs();
+    for (; SDL_AtomicGet(&audio_command_tail) != SDL_AtomicGet(&audio_command_head); SDL_AtomicAdd(&audio_command_tail, 1))
+        SDL_free(audio_commands[(Uint32)SDL_AtomicGet(&audio_command_tail) % AUDIO_COMMANDS].song);
+    for (i = 0; i < AUDIO_VOICES; ++i)
+        SDL_free(audio_voices[i].song);
+    SDL_zero(audio_voices);
+    for (; layer_count > 1; --layer_count)
+        SDL_FreeSurface(layers[layer_count - 1].surface);
     if (surface8 != NULL)
         SDL_FreeSurface(surface8);
-    if (surface32 != NULL)
-        SDL_FreeSurface(surface32);
+    target = surface8 = NULL;
+    target_layer = NULL;
+    SDL_free(present_memory);
+    present_memory = NULL;
     if (texture != NULL)
         SDL_DestroyTexture(texture);
     if (renderer != NULL)
         SDL_DestroyRenderer(renderer);
     if (window != NULL)
         SDL_DestroyWindow(window);
+    while (pool_chunks != NULL) {
+        pool_chunk_t        *chunk = pool_chunks;
+        pool_chunks = chunk->next;
+        SDL_free(chunk);
+    }
 
     SDL_Quit();
 }
@@ -1240,8 +4296,15 @@ static void shutdown_ltro1() {
 /*----------------------------------------------------------------------------*/
 int main(int argc, char **argv) {
     lua_State               *L;
-
-    (void)argc; (void)argv;
+    int                     i;
+
+    for (i = 1; i < argc; ++i) {
+        if (SDL_strcmp(argv[i], "--headless") == 0) headless = 1;
+        else if (SDL_strcmp(argv[i], "--frames") == 0 && i + 1 < argc) headless_frames = SDL_atoi(argv[++i]);
+        else if (SDL_strcmp(argv[i], "--record") == 0 && i + 1 < argc) { replay_mode = REPLAY_RECORD; replay_path = argv[++i]; }
+        else if (SDL_strcmp(argv[i], "--replay") == 0 && i + 1 < argc) { replay_mode = REPLAY_PLAY; replay_path = argv[++i]; }
+        else if (SDL_strcmp(argv[i], "--verify") == 0) replay_verify = 1;
+    }
 
     L = luaL_newstate();
     luaL_openlibs(L);
@@ -1255,11 +4318,13 @@ int main(int argc, char **argv) {
     lua_pushcfunction(L, initialize_ltro1);
     if (lua_pcall(L, 0, 0, -2) != LUA_OK) {
         const char          *message = luaL_gsub(L, lua_tostring(L, -1), "\t", "    ");
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "LTRO-1 Panic!", message, window);
+        if (headless)   SDL_Log("LTRO-1 Panic!: %s", message);
+        else            SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "LTRO-1 Panic!", message, window);
     }
 
     lua_close(L);
+    finish_replay();
     shutdown_ltro1();
 
-    return 0;
+    return replay_failed ? 1 : 0;
 }